@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
@@ -24,9 +25,22 @@
 #define HL_STRING 6
 #define HL_NUMBER 7
 #define HL_MATCH 8      /* Search match. */
+#define HL_BRACKET 9    /* Bracket matching the one at the cursor. */
 
 #define HL_HIGHLIGHT_STRINGS (1<<0)
 #define HL_HIGHLIGHT_NUMBERS (1<<1)
+#define HL_SYMBOLS_C (1<<2)     /* Index C function definitions. */
+#define HL_SYMBOLS_LOX (1<<3)   /* Index Lox 'fun' and 'class'. */
+#define HL_SYMBOLS_BASIC (1<<4) /* Index BASIC line numbers. */
+
+/* Lexer state a row starts in. Only a multi line comment or a string
+ * continued with a trailing '\\' can span rows, so two bits are enough. */
+#define HL_STATE_NORMAL 0
+#define HL_STATE_MLCOMMENT 1
+#define HL_STATE_DQUOTE 2
+#define HL_STATE_SQUOTE 3
+
+#define BR_BLOCK 16     /* Rows per leaf of the bracket summary tree. */
 
 #include "vga_font.h"
 
@@ -43,7 +57,14 @@ static char *helpText =
     "Operations\n"
     "----------\n"
     "Ctrl+W  Where is (Search)\n"
+    "Ctrl+E  Replace (y/n/a for each match)\n"
+    "Ctrl+F  Search in files, Enter opens a hit\n"
     "Ctrl+R  Run Program\n"
+    "Ctrl+L  Show/Hide line numbers\n"
+    "Ctrl+T  Soft wrap long lines on/off\n"
+    "Ctrl+B  Jump to matching bracket\n"
+    "Ctrl+O  Pick a symbol to jump to\n"
+    "Ctrl+D  Jump to definition under the cursor\n"
     "\n"
     "Moving around\n"
     "-------------\n"
@@ -55,9 +76,7 @@ static char *helpText =
     "Down        One line down\n"
     "Ctrl+Up     One page up\n"
     "Ctrl+Down   One page down\n"
-    "Ctrl+G  [*] Go to Line\n"
-    "\n"
-    "[*] = WIP, Comming Soon.\n"
+    "Ctrl+G      Go to line, +N/-N relative\n"
     "\n"
     ">> PRESS ANYKEY TO EXIT <<\n";
 
@@ -65,6 +84,13 @@ static int chan_dev = 0;
 static unsigned char initialFgColor = 0;
 static unsigned char initialBgColor = 0;
 
+/* Slot of a syntax keyword hash table. */
+struct editorKeyword {
+    char *word;         /* Keyword without the '|' marker, NULL if empty. */
+    int len;            /* Length of word. */
+    int hl;             /* HL_KEYWORD1 or HL_KEYWORD2. */
+};
+
 struct editorSyntax {
     char *extension;
     char *interpreter;
@@ -74,6 +100,63 @@ struct editorSyntax {
     char multiline_comment_end[3];
     int flags;
     struct editorSyntax *next;
+    struct editorKeyword *kwtable;  /* Hash of keywords, built by addSyntax. */
+    unsigned int kwmask;            /* Table size minus one. */
+    unsigned char lexclass[256];    /* LC_* class of every byte. */
+    struct lexStep *dfa;            /* Lexer transitions, see editorBuildLexer. */
+};
+
+/* Lexer character classes. Classes up to LC_DOT end a word. A byte that
+ * may start a comment delimiter also has LC_PAIR set, and is refined into
+ * one of the delimiter classes when the next byte completes it. */
+#define LC_SPACE 0
+#define LC_SEP 1        /* Operator that separates words. */
+#define LC_DOT 2        /* Separator that may also continue a number. */
+#define LC_OTHER 3      /* Printable char that is part of a word. */
+#define LC_IDENT 4      /* Letter or '_', may start a keyword. */
+#define LC_DIGIT 5      /* Only when the syntax highlights numbers. */
+#define LC_DQUOTE 6     /* Only when the syntax highlights strings. */
+#define LC_SQUOTE 7
+#define LC_BACKSLASH 8
+#define LC_NONPRINT 9
+#define LC_SCS 10       /* Single line comment start. */
+#define LC_MCS 11       /* Multi line comment start. */
+#define LC_MCE 12       /* Multi line comment end. */
+#define LC_COUNT 13
+#define LC_PAIR 0x80
+
+/* Lexer states. The S_*_SEP string states are only entered when a row
+ * starts inside a continued string and mean a word may start right after
+ * the closing quote. */
+#define LS_SEP 0        /* At the start of a word. */
+#define LS_WORD 1       /* Inside a word. */
+#define LS_NUM 2        /* Inside a number. */
+#define LS_MLC 3        /* Inside a multi line comment. */
+#define LS_DQ 4
+#define LS_DQ_SEP 5
+#define LS_DQ_ESC 6     /* After a backslash inside "". */
+#define LS_SQ 7
+#define LS_SQ_SEP 8
+#define LS_SQ_ESC 9
+#define LS_COUNT 10
+
+/* What a transition does with the bytes at the current position. */
+#define LA_STEP 0       /* Highlight one byte. */
+#define LA_PAIR 1       /* Highlight a two byte delimiter. */
+#define LA_REST 2       /* Highlight the rest of the row. */
+#define LA_KEYWORD 3    /* Try a keyword, otherwise like LA_STEP. */
+
+struct lexStep {
+    unsigned char next;     /* LS_* state after the step. */
+    unsigned char hl;       /* HL_* type of the consumed bytes. */
+    unsigned char action;   /* LA_* */
+};
+
+/* A run of rendered characters sharing one highlight type. */
+struct hlSpan {
+    int start;          /* Render offset of the first character. */
+    int len;            /* Number of characters. */
+    unsigned char hl;   /* HL_* type of the run. */
 };
 
 /* This structure represents a single line of the file we are editing. */
@@ -83,9 +166,19 @@ typedef struct erow {
     int rsize;          /* Size of the rendered row. */
     char *chars;        /* Row content. */
     char *render;       /* Row content "rendered" for screen (for TABs). */
-    unsigned char *hl;  /* Syntax highlight type for each character in render.*/
-    int hl_oc;          /* Row had open comment at end in last syntax highlight
-                           check. */
+    struct hlSpan *hl;  /* Highlighted runs of render, in order. Characters
+                           outside every span are HL_NORMAL. */
+    int nhl;            /* Number of spans in 'hl'. */
+    int br_net;         /* Bracket depth change over the row. */
+    int br_min;         /* Lowest bracket depth within the row. */
+    char *sym;          /* Symbol defined by the row, or NULL. */
+    unsigned char hl_start; /* HL_STATE_* the row starts in. Only valid
+                               for rows before E.hl_lo. */
+    int *wrap;          /* Render offset where each visual line starts. */
+    int nvis;           /* Number of visual lines in soft wrap mode. */
+    int wrapcols;       /* Text width 'wrap' was computed for, 0 if stale. */
+    int vis;            /* Index of the row's first visual line. */
+    int nmatch;         /* Matches of the counted query, -1 if stale. */
 } erow;
 
 struct editorConfig {
@@ -94,22 +187,70 @@ struct editorConfig {
     int coloff;     /* Offset of column displayed. */
     int screenrows; /* Number of rows that we can show */
     int screencols; /* Number of cols that we can show */
+    int textcols;   /* Columns left for text once the gutter is drawn. */
+    int linenums;   /* Is the line number gutter enabled? */
+    int gutter;     /* Gutter width including the separator, 0 if off. */
+    int gutter_limit;   /* First line count that needs a wider gutter. */
+    int gutter_top;     /* Line number held in gutter_digits, 0 if none. */
+    char gutter_digits[12]; /* Right aligned ASCII digits of gutter_top. */
+    int softwrap;   /* Wrap long rows instead of scrolling horizontally? */
+    int vtop;       /* First visual line shown in soft wrap mode. */
+    int *vis_row;   /* Row index of every visual line. */
+    int numvis;     /* Number of visual lines. */
+    int vis_cols;   /* Text width the visual line index was built for. */
+    int vis_lo;     /* First row whose visual lines moved, or INT_MAX. */
     int numrows;    /* Number of rows */
     int rawmode;    /* Is terminal raw mode enabled? */
     erow *row;      /* Rows */
     int dirty;      /* File modified but not saved. */
     char *filename; /* Currently open filename */
     char statusmsg[80];
-    long statusmsg_time;
+    int statusmsglen;           /* Length of statusmsg, 0 once expired. */
+    long statusmsg_deadline;    /* Jiffies at which statusmsg expires. */
+    char *statusbar;            /* Prerendered status bar, screencols wide. */
+    const char *sb_filename;    /* State statusbar was rendered from. */
+    int sb_numrows, sb_dirty, sb_line, sb_cols;
     struct editorSyntax *syntax;    /* Current syntax highlight, or NULL. */
+    int hl_lo;      /* Frontier: first row whose highlight may be stale. */
+    int hl_hi;      /* Last row the re-highlight sweep must reach. */
+    int hl_eof;     /* HL_STATE_* the last row ends in. */
+    struct brNode *br_tree; /* Bracket summary of blocks of rows. */
+    int br_size;    /* Leaves in br_tree, a power of two. */
+    int br_rebuild; /* Lay out br_tree afresh on its next use. */
+    int *syms;      /* Rows defining a symbol, sorted by symbol name. */
+    int nsyms;      /* Number of entries in 'syms'. */
+    unsigned char *tri_bits;    /* Trigram index: block bitmap per bucket,
+                                   NULL if not built. */
+    unsigned char *tri_stale;   /* Per block, set while its bits are out
+                                   of date. */
+    int tri_rows;   /* Rows per block, a power of two. */
+    int tri_cap;    /* Blocks the bitmaps have room for. */
+    int tri_nstale; /* Number of stale blocks. */
+    int tri_off;    /* Index dropped for lack of memory. */
+    int tri_report; /* Report the index size once it is complete. */
 };
 
 static struct editorConfig E;
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorWrapRow(erow *row);
+void editorUpdateBrackets(erow *row);
+void editorUpdateSymbol(erow *row);
+void symRemove(erow *row);
+void symShift(int at, int delta);
+void brMark(int at, int delta);
+void triMarkRow(int at);
+void matchCacheView(int lo, int hi);
+struct hlSpan *matchCacheRow(int filerow, int *n);
+void triShift(int at);
+void triFree(void);
+void matchCountMarkRow(int at);
+void matchCountShift(int at, int delta);
+void matchCountUse(const char *query, int len, int flags);
 void updateCursorGlyph();
 void restoreDisplay();
 void runInterpreter();
+void editorLoadSyntaxDefs(void);
 void showHelp();
 ssize_t getdelim(char **buf, size_t *bufsiz, int delimiter, FILE *fp);
 ssize_t getline(char **buf, size_t *bufsiz, FILE *fp);
@@ -125,6 +266,8 @@ ssize_t getline(char **buf, size_t *bufsiz, FILE *fp);
  * The list of keywords to highlight is just a list of words, however if they
  * a trailing '|' character is added at the end, they are highlighted in
  * a different color, so that you can have two different sets of keywords.
+ * addSyntax() turns the list into a hash table once, so the lexer does a
+ * single lookup per word.
  *
  * Finally add a stanza in the HLDB global variable with two two arrays
  * of strings, and a set of flags in order to enable highlighting of
@@ -179,8 +322,9 @@ struct editorSyntax cSyntax = {
     "",
     C_HL_keywords,
     "//","/*","*/",
-    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-    NULL
+    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS | HL_SYMBOLS_C,
+    NULL,
+    NULL,0,{0},NULL     /* Tables built by addSyntax. */
 };
 
 struct editorSyntax hSyntax = {
@@ -188,8 +332,9 @@ struct editorSyntax hSyntax = {
     "",
     C_HL_keywords,
     "//","/*","*/",
-    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-    NULL
+    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS | HL_SYMBOLS_C,
+    NULL,
+    NULL,0,{0},NULL     /* Tables built by addSyntax. */
 };
 
 struct editorSyntax basSyntax = {
@@ -197,8 +342,9 @@ struct editorSyntax basSyntax = {
     "basic.pgz",
     BAS_HL_keywords,
     "//","/*","*/",
-    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-    NULL
+    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS | HL_SYMBOLS_BASIC,
+    NULL,
+    NULL,0,{0},NULL     /* Tables built by addSyntax. */
 };
 
 struct editorSyntax loxSyntax = {       
@@ -206,12 +352,147 @@ struct editorSyntax loxSyntax = {
     "lox.pgz",
     Lox_HL_keywords,
     "//","/*","*/",
-    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS,
-    NULL
+    HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS | HL_SYMBOLS_LOX,
+    NULL,
+    NULL,0,{0},NULL     /* Tables built by addSyntax. */
 };
 
 
+/* Hash of a keyword candidate, mixing its length and both ends so that
+ * keywords sharing a prefix land in different slots. */
+#define KW_HASH(s,len) ((unsigned int)(len)*31 + \
+                        (unsigned char)(s)[0]*7 + (unsigned char)(s)[(len)-1])
+
+/* Build the keyword hash table of a syntax from its keyword list. The '|'
+ * marker is resolved here, so the lexer gets the highlight type directly. */
+void editorBuildKeywords(struct editorSyntax *syntax) {
+    unsigned int count = 0, size = 16, j;
+
+    while (syntax->keywords[count]) count++;
+    while (size < count*2) size *= 2;
+    syntax->kwtable = calloc(size,sizeof(struct editorKeyword));
+    syntax->kwmask = size-1;
+
+    for (j = 0; j < count; j++) {
+        char *kw = syntax->keywords[j];
+        int len = strlen(kw);
+        int hl = HL_KEYWORD1;
+        if (len && kw[len-1] == '|') {
+            len--;
+            hl = HL_KEYWORD2;
+        }
+        if (len == 0) continue;
+        unsigned int h = KW_HASH(kw,len) & syntax->kwmask;
+        while (syntax->kwtable[h].word) h = (h+1) & syntax->kwmask;
+        syntax->kwtable[h].word = kw;
+        syntax->kwtable[h].len = len;
+        syntax->kwtable[h].hl = hl;
+    }
+}
+
+/* Return the highlight type of the 'len' chars at 's' if they are a
+ * keyword of the current syntax, otherwise HL_NORMAL. */
+int editorKeywordLookup(const char *s, int len) {
+    struct editorSyntax *syntax = E.syntax;
+    unsigned int h = KW_HASH(s,len) & syntax->kwmask;
+
+    while (syntax->kwtable[h].word) {
+        struct editorKeyword *kw = &syntax->kwtable[h];
+        if (kw->len == len && !memcmp(kw->word,s,len)) return kw->hl;
+        h = (h+1) & syntax->kwmask;
+    }
+    return HL_NORMAL;
+}
+
+/* Classify every byte once for the given syntax. Flags that disable
+ * strings or numbers simply leave those classes out. */
+void editorBuildLexClass(struct editorSyntax *syntax) {
+    unsigned char *lc = syntax->lexclass;
+    char *sep = ",()+-/*=~%[];";
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        if (c >= 128 || !isprint(c)) lc[c] = LC_NONPRINT;
+        else if (isalpha(c) || c == '_') lc[c] = LC_IDENT;
+        else if (isdigit(c) && (syntax->flags & HL_HIGHLIGHT_NUMBERS))
+            lc[c] = LC_DIGIT;
+        else lc[c] = LC_OTHER;
+        if (c < 128 && isspace(c)) lc[c] = LC_SPACE;
+    }
+    while (*sep) lc[(unsigned char)*sep++] = LC_SEP;
+    lc['.'] = LC_DOT;
+    lc['\\'] = LC_BACKSLASH;
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        lc['"'] = LC_DQUOTE;
+        lc['\''] = LC_SQUOTE;
+    }
+    if (syntax->singleline_comment_start[0])
+        lc[(unsigned char)syntax->singleline_comment_start[0]] |= LC_PAIR;
+    if (syntax->multiline_comment_start[0])
+        lc[(unsigned char)syntax->multiline_comment_start[0]] |= LC_PAIR;
+    if (syntax->multiline_comment_end[0])
+        lc[(unsigned char)syntax->multiline_comment_end[0]] |= LC_PAIR;
+}
+
+/* Compile the lexer of a syntax into a LS_COUNT x LC_COUNT transition
+ * table, so highlighting a row is one table step per byte. */
+void editorBuildLexer(struct editorSyntax *syntax) {
+    struct lexStep *t;
+    int st, c;
+
+    syntax->dfa = t = malloc(sizeof(struct lexStep)*LS_COUNT*LC_COUNT);
+#define LEX(st,c,n,h,a) do { \
+    struct lexStep *e = &t[(st)*LC_COUNT+(c)]; \
+    e->next = (n); e->hl = (h); e->action = (a); \
+} while(0)
+
+    /* Outside strings and comments. */
+    for (st = LS_SEP; st <= LS_NUM; st++) {
+        for (c = 0; c < LC_COUNT; c++) LEX(st,c,LS_WORD,HL_NORMAL,LA_STEP);
+        LEX(st,LC_SPACE,LS_SEP,HL_NORMAL,LA_STEP);
+        LEX(st,LC_SEP,LS_SEP,HL_NORMAL,LA_STEP);
+        LEX(st,LC_DOT,LS_SEP,HL_NORMAL,LA_STEP);
+        LEX(st,LC_NONPRINT,LS_WORD,HL_NONPRINT,LA_STEP);
+        LEX(st,LC_DQUOTE,LS_DQ,HL_STRING,LA_STEP);
+        LEX(st,LC_SQUOTE,LS_SQ,HL_STRING,LA_STEP);
+        LEX(st,LC_MCS,LS_MLC,HL_MLCOMMENT,LA_PAIR);
+    }
+    LEX(LS_SEP,LC_IDENT,LS_WORD,HL_NORMAL,LA_KEYWORD);
+    LEX(LS_SEP,LC_DIGIT,LS_NUM,HL_NUMBER,LA_STEP);
+    LEX(LS_SEP,LC_SCS,LS_SEP,HL_COMMENT,LA_REST);
+    LEX(LS_NUM,LC_DIGIT,LS_NUM,HL_NUMBER,LA_STEP);
+    LEX(LS_NUM,LC_DOT,LS_NUM,HL_NUMBER,LA_STEP);
+
+    /* Multi line comment. */
+    for (c = 0; c < LC_COUNT; c++) LEX(LS_MLC,c,LS_MLC,HL_MLCOMMENT,LA_STEP);
+    LEX(LS_MLC,LC_MCE,LS_SEP,HL_MLCOMMENT,LA_PAIR);
+
+    /* Strings: a backslash escapes the next byte, the closing quote goes
+     * back to LS_WORD, or LS_SEP for a string continued from the row
+     * above. */
+    for (c = 0; c < LC_COUNT; c++) {
+        LEX(LS_DQ,c,LS_DQ,HL_STRING,LA_STEP);
+        LEX(LS_DQ_SEP,c,LS_DQ_SEP,HL_STRING,LA_STEP);
+        LEX(LS_DQ_ESC,c,LS_DQ,HL_STRING,LA_STEP);
+        LEX(LS_SQ,c,LS_SQ,HL_STRING,LA_STEP);
+        LEX(LS_SQ_SEP,c,LS_SQ_SEP,HL_STRING,LA_STEP);
+        LEX(LS_SQ_ESC,c,LS_SQ,HL_STRING,LA_STEP);
+    }
+    LEX(LS_DQ,LC_BACKSLASH,LS_DQ_ESC,HL_STRING,LA_STEP);
+    LEX(LS_DQ_SEP,LC_BACKSLASH,LS_DQ_ESC,HL_STRING,LA_STEP);
+    LEX(LS_DQ,LC_DQUOTE,LS_WORD,HL_STRING,LA_STEP);
+    LEX(LS_DQ_SEP,LC_DQUOTE,LS_SEP,HL_STRING,LA_STEP);
+    LEX(LS_SQ,LC_BACKSLASH,LS_SQ_ESC,HL_STRING,LA_STEP);
+    LEX(LS_SQ_SEP,LC_BACKSLASH,LS_SQ_ESC,HL_STRING,LA_STEP);
+    LEX(LS_SQ,LC_SQUOTE,LS_WORD,HL_STRING,LA_STEP);
+    LEX(LS_SQ_SEP,LC_SQUOTE,LS_SEP,HL_STRING,LA_STEP);
+#undef LEX
+}
+
 void addSyntax(struct editorSyntax *syntax) {
+    editorBuildLexClass(syntax);
+    editorBuildLexer(syntax);
+    editorBuildKeywords(syntax);
     syntax->next = HLDB;
     HLDB = syntax;
 }
@@ -221,6 +502,7 @@ void initHLDB() {
     addSyntax(&hSyntax);
     addSyntax(&basSyntax);
     addSyntax(&loxSyntax);
+    editorLoadSyntaxDefs();
 }
 
 
@@ -251,174 +533,295 @@ int enableRawMode() {
 
 /* ====================== Syntax highlight color scheme  ==================== */
 
-int is_separator(int c) {
-    return c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL;
+/* Queue row 'at' to be highlighted again because the state it starts in
+ * may have changed. */
+void editorSyntaxInvalidate(int at) {
+    if (at < E.hl_lo) E.hl_lo = at;
+    if (at > E.hl_hi) E.hl_hi = at;
 }
 
-/* Return true if the specified row last char is part of a multi line comment
- * that starts at this row or at one before, and does not end at the end
- * of the row but spawns to the next row. */
-int editorRowHasOpenComment(erow *row) {
-    if (row->hl && row->rsize && row->hl[row->rsize-1] == HL_MLCOMMENT &&
-        (row->rsize < 2 || (row->render[row->rsize-2] != '*' ||
-                            row->render[row->rsize-1] != '/'))) return 1;
-    return 0;
+/* Refine a byte flagged LC_PAIR into a comment delimiter class when it and
+ * the next byte form a delimiter that is meaningful in state 'st'. A line
+ * comment only starts at the beginning of a word. */
+int editorLexPair(int st, char *p, int class) {
+    struct editorSyntax *syn = E.syntax;
+
+    if (st <= LS_NUM) {
+        if (st == LS_SEP && p[0] == syn->singleline_comment_start[0] &&
+            p[1] == syn->singleline_comment_start[1]) return LC_SCS;
+        if (p[0] == syn->multiline_comment_start[0] &&
+            p[1] == syn->multiline_comment_start[1]) return LC_MCS;
+    } else if (st == LS_MLC) {
+        if (p[0] == syn->multiline_comment_end[0] &&
+            p[1] == syn->multiline_comment_end[1]) return LC_MCE;
+    }
+    return class;
 }
 
-/* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void editorUpdateSyntax(erow *row) {
-    return;
-    row->hl = realloc(row->hl,row->rsize);
-    memset(row->hl,HL_NORMAL,row->rsize);
-
-    if (E.syntax == NULL) return; /* No syntax, everything is HL_NORMAL. */
+/* Spans produced by the lexer are collected here, and copied to the row
+ * once it is done, so a row is reallocated only once per update. */
+static struct hlSpan *hlScratch = NULL;
+static int hlScratchLen = 0, hlScratchCap = 0;
+
+/* Append a span to hlScratch. HL_NORMAL runs are implied by the gaps
+ * between spans, so they are not stored. */
+void hlPush(int start, int len, int h) {
+    if (len <= 0 || h == HL_NORMAL) return;
+    if (hlScratchLen == hlScratchCap) {
+        hlScratchCap = hlScratchCap ? hlScratchCap*2 : 32;
+        hlScratch = realloc(hlScratch,sizeof(struct hlSpan)*hlScratchCap);
+    }
+    hlScratch[hlScratchLen].start = start;
+    hlScratch[hlScratchLen].len = len;
+    hlScratch[hlScratchLen].hl = h;
+    hlScratchLen++;
+}
 
-    int i, prev_sep, in_string, in_comment;
-    char *p;
-    char **keywords = E.syntax->keywords;
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-
-    /* Point to the first non-space char. */
-    p = row->render;
-    i = 0; /* Current char offset */
-    while(*p && isspace(*p)) {
-        p++;
-        i++;
+/* Replace the spans of 'row' with the ones collected in hlScratch. */
+void hlCommit(erow *row) {
+    row->nhl = hlScratchLen;
+    if (hlScratchLen == 0) {
+        free(row->hl);
+        row->hl = NULL;
+        return;
     }
-    prev_sep = 1; /* Tell the parser if 'i' points to start of word. */
-    in_string = 0; /* Are we inside "" or '' ? */
-    in_comment = 0; /* Are we inside multi-line comment? */
+    row->hl = realloc(row->hl,sizeof(struct hlSpan)*hlScratchLen);
+    memcpy(row->hl,hlScratch,sizeof(struct hlSpan)*hlScratchLen);
+}
 
-    /* If the previous line has an open comment, this line starts
-     * with an open comment state. */
-    if (row->idx > 0 && editorRowHasOpenComment(&E.row[row->idx-1]))
-        in_comment = 1;
+/* Set 'len' characters of 'row' starting at 'from' to the highlight type
+ * 'h', splitting the spans it overlaps. */
+void hlFill(erow *row, int from, int len, int h) {
+    int end = from+len, placed = 0, j;
 
-    while(*p) {
-        /* Handle // comments. */
-        if (prev_sep && *p == scs[0] && *(p+1) == scs[1]) {
-            /* From here to end is a comment */
-            memset(row->hl+i,HL_COMMENT,row->size-i);
-            return;
-        }
+    hlScratchLen = 0;
+    for (j = 0; j < row->nhl; j++) {
+        struct hlSpan *sp = &row->hl[j];
+        int spend = sp->start+sp->len;
 
-        /* Handle multi line comments. */
-        if (in_comment) {
-            row->hl[i] = HL_MLCOMMENT;
-            if (*p == mce[0] && *(p+1) == mce[1]) {
-                row->hl[i+1] = HL_MLCOMMENT;
-                p += 2; i += 2;
-                in_comment = 0;
-                prev_sep = 1;
-                continue;
-            } else {
-                prev_sep = 0;
-                p++; i++;
-                continue;
+        if (spend <= from || sp->start >= end) {
+            if (!placed && sp->start >= end) {
+                hlPush(from,len,h);
+                placed = 1;
             }
-        } else if (*p == mcs[0] && *(p+1) == mcs[1]) {
-            row->hl[i] = HL_MLCOMMENT;
-            row->hl[i+1] = HL_MLCOMMENT;
-            p += 2; i += 2;
-            in_comment = 1;
-            prev_sep = 0;
+            hlPush(sp->start,sp->len,sp->hl);
             continue;
         }
-
-        /* Handle "" and '' */
-        if (in_string) {
-            row->hl[i] = HL_STRING;
-            if (*p == '\\') {
-                row->hl[i+1] = HL_STRING;
-                p += 2; i += 2;
-                prev_sep = 0;
-                continue;
-            }
-            if (*p == in_string) in_string = 0;
-            p++; i++;
-            continue;
-        } else {
-            if (*p == '"' || *p == '\'') {
-                in_string = *p;
-                row->hl[i] = HL_STRING;
-                p++; i++;
-                prev_sep = 0;
-                continue;
-            }
+        if (sp->start < from) hlPush(sp->start,from-sp->start,sp->hl);
+        if (!placed) {
+            hlPush(from,len,h);
+            placed = 1;
         }
+        if (spend > end) hlPush(end,spend-end,sp->hl);
+    }
+    if (!placed) hlPush(from,len,h);
+    hlCommit(row);
+}
 
-        /* Handle non printable chars. */
-        if (!isprint(*p)) {
-            row->hl[i] = HL_NONPRINT;
-            p++; i++;
-            prev_sep = 0;
-            continue;
-        }
+/* Return the highlight type of render column 'i' of 'row'. */
+int hlTypeAt(erow *row, int i) {
+    int lo = 0, hi = row->nhl-1;
 
-        /* Handle numbers */
-        if ((isdigit(*p) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-            (*p == '.' && i >0 && row->hl[i-1] == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
-            p++; i++;
-            prev_sep = 0;
-            continue;
-        }
+    while (lo <= hi) {
+        int mid = (lo+hi)/2;
+        struct hlSpan *sp = &row->hl[mid];
+        if (i < sp->start) hi = mid-1;
+        else if (i >= sp->start+sp->len) lo = mid+1;
+        else return sp->hl;
+    }
+    return HL_NORMAL;
+}
 
-        /* Handle keywords and lib calls */
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen-1] == '|';
-                if (kw2) klen--;
-
-                if (!memcmp(p,keywords[j],klen) &&
-                    is_separator(*(p+klen)))
-                {
-                    /* Keyword */
-                    memset(row->hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                    p += klen;
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue; /* We had a keyword match */
+/* Is render column 'i' of 'row' inside a comment or a string? */
+int hlIsText(erow *row, int i) {
+    int h = hlTypeAt(row,i);
+    return h == HL_COMMENT || h == HL_MLCOMMENT || h == HL_STRING;
+}
+
+/* Return a copy of the highlight of 'row', to be put back later with
+ * editorRestoreHighlight(). The copy ends with an empty span. */
+struct hlSpan *editorSaveHighlight(erow *row) {
+    struct hlSpan *saved = malloc(sizeof(struct hlSpan)*(row->nhl+1));
+
+    if (row->nhl) memcpy(saved,row->hl,sizeof(struct hlSpan)*row->nhl);
+    saved[row->nhl].len = 0;
+    return saved;
+}
+
+/* Put back and free a highlight saved by editorSaveHighlight(). */
+void editorRestoreHighlight(erow *row, struct hlSpan *saved) {
+    int j;
+
+    hlScratchLen = 0;
+    for (j = 0; saved[j].len; j++)
+        hlPush(saved[j].start,saved[j].len,saved[j].hl);
+    hlCommit(row);
+    free(saved);
+}
+
+/* Rebuild the highlight spans of a row, setting every character to the
+ * right syntax highlight type (HL_* defines), walking the row through
+ * the transition table of the current syntax, starting in row->hl_start.
+ * If the next row now starts in a different state it is queued for
+ * editorSyntaxCatchUp() instead of recursing; 1 is returned in that case. */
+int editorUpdateSyntax(erow *row) {
+    int state = row->hl_start;
+
+    hlScratchLen = 0;
+    if (E.syntax == NULL) {
+        hlCommit(row);  /* No syntax, everything is HL_NORMAL. */
+        editorUpdateBrackets(row);
+        editorUpdateSymbol(row);
+        return 0;
+    }
+
+    unsigned char *lc = E.syntax->lexclass;
+    struct lexStep *dfa = E.syntax->dfa;
+    char *p = row->render;
+    int i = 0, st;
+    int run = 0, runhl = HL_NORMAL; /* Start and type of the open span. */
+
+    /* Characters are typed in order, so a span is only closed when the
+     * type changes. */
+#define HL_EMIT(at,h) do { \
+    if ((h) != runhl) { \
+        hlPush(run,(at)-run,runhl); \
+        run = (at); \
+        runhl = (h); \
+    } \
+} while(0)
+
+    if (state == HL_STATE_MLCOMMENT) st = LS_MLC;
+    else if (state == HL_STATE_DQUOTE) st = LS_DQ_SEP;
+    else if (state == HL_STATE_SQUOTE) st = LS_SQ_SEP;
+    else st = LS_SEP;
+
+    while (i < row->rsize) {
+        int class = lc[(unsigned char)p[i]];
+        if (class & LC_PAIR) class = editorLexPair(st,p+i,class & ~LC_PAIR);
+        struct lexStep *t = &dfa[st*LC_COUNT+class];
+
+        if (t->action == LA_KEYWORD) {
+            int klen = 1, kw;
+            while (i+klen < row->rsize &&
+                   (lc[(unsigned char)p[i+klen]] & ~LC_PAIR) > LC_DOT) klen++;
+            if ((kw = editorKeywordLookup(p+i,klen)) != HL_NORMAL) {
+                HL_EMIT(i,kw);
+                i += klen;
+                st = LS_WORD;
+                continue;
             }
+        } else if (t->action == LA_PAIR) {
+            HL_EMIT(i,t->hl);
+            i++;
+        } else if (t->action == LA_REST) {
+            HL_EMIT(i,t->hl);
+            i = row->rsize;
+            st = t->next;
+            break;
         }
-
-        /* Not special chars */
-        prev_sep = is_separator(*p);
-        p++; i++;
+        HL_EMIT(i,t->hl);
+        i++;
+        st = t->next;
+    }
+    hlPush(run,row->rsize-run,runhl);
+    hlCommit(row);
+    editorUpdateBrackets(row);
+    editorUpdateSymbol(row);
+#undef HL_EMIT
+
+    /* Only a string continued with a trailing backslash survives the end of
+     * the row. If the end state changed the next row must be redone too. */
+    if (st == LS_MLC) state = HL_STATE_MLCOMMENT;
+    else if (st == LS_DQ_ESC) state = HL_STATE_DQUOTE;
+    else if (st == LS_SQ_ESC) state = HL_STATE_SQUOTE;
+    else state = HL_STATE_NORMAL;
+    if (row->idx+1 == E.numrows) {
+        E.hl_eof = state;
+    } else if (E.row[row->idx+1].hl_start != state) {
+        E.row[row->idx+1].hl_start = state;
+        editorSyntaxInvalidate(row->idx+1);
+        return 1;
     }
+    return 0;
+}
 
-    /* Propagate syntax change to the next row if the open commen
-     * state changed. This may recursively affect all the following rows
-     * in the file. */
-    int oc = editorRowHasOpenComment(row);
-    if (row->hl_oc != oc && row->idx+1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx+1]);
-    row->hl_oc = oc;
+/* Return the last file row drawn on screen. */
+int editorLastVisibleRow(void) {
+    if (E.softwrap) {
+        int v = E.vtop+E.screenrows-1;
+        if (v >= E.numvis) v = E.numvis-1;
+        return (v >= 0) ? E.vis_row[v] : -1;
+    }
+    return E.rowoff+E.screenrows-1;
 }
 
-/* Maps syntax highlight token types to terminal colors. */
-int editorSyntaxToColor(int hl) {
-    switch(hl) {
-    case HL_COMMENT:
-    case HL_MLCOMMENT: return 36;     /* cyan */
-    case HL_KEYWORD1: return 33;    /* yellow */
-    case HL_KEYWORD2: return 32;    /* green */
-    case HL_STRING: return 35;      /* magenta */
-    case HL_NUMBER: return 31;      /* red */
-    case HL_MATCH: return 34;      /* blu */
-    default: return 37;             /* white */
+/* Bring highlighting up to date down to row 'last'. Rows from the frontier
+ * E.hl_lo are lexed in order, as each one's start state depends on the row
+ * above. The sweep ends early at the first row past E.hl_hi that leaves the
+ * next row's start state unchanged, so an edit costs at most the rows down
+ * to the bottom of the screen. Rows further down are lexed once scrolled
+ * into view. */
+void editorSyntaxCatchUp(int last) {
+    if (last >= E.numrows) last = E.numrows-1;
+    while (E.hl_lo <= last) {
+        erow *row = &E.row[E.hl_lo];
+        int changed = editorUpdateSyntax(row);
+        E.hl_lo = row->idx+1;
+        if (!changed && row->idx >= E.hl_hi) break;
+    }
+    if (E.hl_lo >= E.numrows || E.hl_lo > E.hl_hi) {
+        E.hl_lo = INT_MAX;
+        E.hl_hi = -1;
     }
 }
 
+/* Terminal attributes used by the renderer. Several highlight types share
+ * the same attribute (both comment flavours are cyan), so run boundaries are
+ * detected by comparing attributes, not highlight types. */
+#define ATTR_NONE -1    /* Terminal attribute unknown, force the next SGR. */
+#define ATTR_NORMAL 0
+#define ATTR_INVERSE 1
+#define ATTR_CYAN 2
+#define ATTR_YELLOW 3
+#define ATTR_GREEN 4
+#define ATTR_MAGENTA 5
+#define ATTR_RED 6
+#define ATTR_BLUE 7
+#define ATTR_CYAN_BG 8
+
+/* Every sequence sets both foreground and background. Between two
+ * attributes on the black background only the foreground changes: the
+ * first SGR_FG_LEN bytes of the sequence followed by 'm' are enough. */
+#define SGR_LEN 8
+#define SGR_FG_LEN 4
+#define ATTR_ON_BLACK(a) ((a) != ATTR_INVERSE && (a) != ATTR_CYAN_BG)
+static const char attrToSGR[][SGR_LEN+1] = {
+    "\x1b[37;40m",     /* ATTR_NORMAL: white on black */
+    "\x1b[30;47m",     /* ATTR_INVERSE: black on white */
+    "\x1b[36;40m",     /* ATTR_CYAN */
+    "\x1b[33;40m",     /* ATTR_YELLOW */
+    "\x1b[32;40m",     /* ATTR_GREEN */
+    "\x1b[35;40m",     /* ATTR_MAGENTA */
+    "\x1b[31;40m",     /* ATTR_RED */
+    "\x1b[34;40m",     /* ATTR_BLUE */
+    "\x1b[30;46m"      /* ATTR_CYAN_BG: black on cyan */
+};
+
+/* Maps syntax highlight token types to terminal attributes. */
+static const unsigned char hlToAttr[] = {
+    ATTR_NORMAL,        /* HL_NORMAL */
+    ATTR_INVERSE,       /* HL_NONPRINT */
+    ATTR_CYAN,          /* HL_COMMENT */
+    ATTR_CYAN,          /* HL_MLCOMMENT */
+    ATTR_YELLOW,        /* HL_KEYWORD1 */
+    ATTR_GREEN,         /* HL_KEYWORD2 */
+    ATTR_MAGENTA,       /* HL_STRING */
+    ATTR_RED,           /* HL_NUMBER */
+    ATTR_BLUE,          /* HL_MATCH */
+    ATTR_CYAN_BG        /* HL_BRACKET */
+};
+
 /* Select the syntax highlight scheme depending on the filename,
  * setting it in the global state E.syntax. */
 
@@ -480,6 +883,17 @@ void editorUpdateRow(erow *row) {
 
     /* Update the syntax highlighting attributes of the row. */
     editorUpdateSyntax(row);
+    triMarkRow(row->idx);
+    matchCountMarkRow(row->idx);
+
+    /* The wrap layout is stale. Lay it out again now when soft wrap is on,
+     * the visual line index only needs updating if the count changed. */
+    row->wrapcols = 0;
+    if (E.softwrap) {
+        int nvis = row->nvis;
+        editorWrapRow(row);
+        if (row->nvis != nvis && row->idx < E.vis_lo) E.vis_lo = row->idx;
+    }
 }
 
 /* Insert a row at the specified position, shifting the other rows on the bottom
@@ -491,17 +905,35 @@ void editorInsertRow(int at, char *s, size_t len) {
         memmove(E.row+at+1,E.row+at,sizeof(E.row[0])*(E.numrows-at));
         for (int j = at+1; j <= E.numrows; j++) E.row[j].idx++;
     }
+    /* Queued re-highlighting moves down with the rows. */
+    if (E.hl_lo != INT_MAX && E.hl_lo >= at) E.hl_lo++;
+    if (E.hl_hi >= at) E.hl_hi++;
+    brMark(at,1);
+    symShift(at,1);
+    matchCountShift(at,1);
     E.row[at].size = len;
     E.row[at].chars = malloc(len+1);
     memcpy(E.row[at].chars,s,len+1);
     E.row[at].hl = NULL;
-    E.row[at].hl_oc = 0;
+    E.row[at].nhl = 0;
+    E.row[at].br_net = 0;
+    E.row[at].br_min = 0;
+    E.row[at].sym = NULL;
+    /* The new row starts where the row it pushed down used to start. */
+    E.row[at].hl_start = (at < E.numrows) ? E.row[at+1].hl_start : E.hl_eof;
     E.row[at].render = NULL;
     E.row[at].rsize = 0;
     E.row[at].idx = at;
-    editorUpdateRow(E.row+at);
+    E.row[at].wrap = NULL;
+    E.row[at].nvis = 0;
+    E.row[at].wrapcols = 0;
+    E.row[at].vis = 0;
+    E.row[at].nmatch = -1;
     E.numrows++;
+    triShift(at);   /* Needs the new row count. */
+    editorUpdateRow(E.row+at);
     E.dirty++;
+    if (at < E.vis_lo) E.vis_lo = at;
 }
 
 /* Free row's heap allocated stuff. */
@@ -509,6 +941,8 @@ void editorFreeRow(erow *row) {
     free(row->render);
     free(row->chars);
     free(row->hl);
+    free(row->wrap);
+    free(row->sym);
 }
 
 /* Remove the row at the specified position, shifting the remainign on the
@@ -518,11 +952,25 @@ void editorDelRow(int at) {
 
     if (at >= E.numrows) return;
     row = E.row+at;
+    /* The next row now starts where the deleted one did. */
+    if (at+1 < E.numrows) E.row[at+1].hl_start = row->hl_start;
+    else E.hl_eof = row->hl_start;
+    if (row->sym) symRemove(row);
+    matchCountShift(at,-1);
+    brMark(at,-1);
     editorFreeRow(row);
     memmove(E.row+at,E.row+at+1,sizeof(E.row[0])*(E.numrows-at-1));
-    for (int j = at; j < E.numrows-1; j++) E.row[j].idx++;
+    for (int j = at; j < E.numrows-1; j++) E.row[j].idx--;
     E.numrows--;
     E.dirty++;
+    if (at < E.vis_lo) E.vis_lo = at;
+
+    /* The row that moved into 'at' now follows a different row. */
+    if (E.hl_lo != INT_MAX && E.hl_lo > at) E.hl_lo--;
+    if (E.hl_hi > at) E.hl_hi--;
+    symShift(at,-1);
+    triShift(at);
+    if (at < E.numrows) editorSyntaxInvalidate(at);
 }
 
 /* Turn the editor rows into a single heap-allocated string.
@@ -608,7 +1056,7 @@ void editorInsertChar(int c) {
     }
     row = &E.row[filerow];
     editorRowInsertChar(row,filecol,c);
-    if (E.cx == E.screencols-1)
+    if (E.cx == E.textcols-1)
         E.coloff++;
     else
         E.cx++;
@@ -671,8 +1119,8 @@ void editorDelChar() {
         else
             E.cy--;
         E.cx = filecol;
-        if (E.cx >= E.screencols) {
-            int shift = (E.screencols-E.cx)+1;
+        if (E.cx >= E.textcols) {
+            int shift = (E.cx-E.textcols)+1;
             E.cx -= shift;
             E.coloff += shift;
         }
@@ -687,6 +1135,39 @@ void editorDelChar() {
     E.dirty++;
 }
 
+/* Drop every row and what was derived from them, leaving the editor as
+ * initEditor() did, ready for editorOpen() to load another file. */
+void editorCloseFile(void) {
+    int j;
+
+    for (j = 0; j < E.numrows; j++) editorFreeRow(&E.row[j]);
+    free(E.row);
+    E.row = NULL;
+    E.numrows = 0;
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    E.dirty = 0;
+    E.syntax = NULL;
+    E.hl_lo = INT_MAX;
+    E.hl_hi = -1;
+    E.hl_eof = HL_STATE_NORMAL;
+    free(E.br_tree);
+    E.br_tree = NULL;
+    E.br_size = 0;
+    E.br_rebuild = 0;
+    free(E.syms);
+    E.syms = NULL;
+    E.nsyms = 0;
+    triFree();
+    E.tri_off = 0;
+    free(E.vis_row);
+    E.vis_row = NULL;
+    E.numvis = 0;
+    E.vtop = 0;
+    E.vis_lo = 0;
+    E.sb_filename = NULL; /* The new name may reuse the old allocation. */
+    matchCountUse(NULL,0,0);
+}
+
 /* Load the specified program in the editor memory and returns 0 on success
  * or 1 on error. */
 int editorOpen(const char *filename) {
@@ -745,274 +1226,2663 @@ writeerr:
     return 1;
 }
 
-/* ============================= Terminal update ============================ */
+/* ================================ Soft wrap =============================== */
+
+/* Compute where the visual lines of 'row' start when it is wrapped at the
+ * current text width. Rows break after the last space that fits, or at the
+ * width when a single word is longer than a line. The result is cached in
+ * the row until it is edited or the width changes. */
+void editorWrapRow(erow *row) {
+    int width = E.textcols-1; /* Last column is never drawn, see refresh. */
+    int start = 0, n = 0;
+
+    if (width < 1) width = 1;
+    row->nvis = 1;
+    while (start+width < row->rsize) {
+        int brk = start+width, j = brk;
+        while (j > start && row->render[j-1] != ' ') j--;
+        if (j > start) brk = j;
+        row->wrap = realloc(row->wrap,sizeof(int)*(n+1));
+        row->wrap[n++] = start;
+        start = brk;
+    }
+    row->wrap = realloc(row->wrap,sizeof(int)*(n+1));
+    row->wrap[n++] = start;
+    row->nvis = n;
+    row->wrapcols = E.textcols;
+}
 
-/* We define a very simple "append buffer" structure, that is an heap
- * allocated string where we can append to. This is useful in order to
- * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
-struct abuf {
-    char *b;
-    int len;
-};
+/* Make sure every row has a current wrap layout and E.vis_row maps each
+ * visual line back to its row, so both directions are a single lookup.
+ * Only rows whose layout is stale are wrapped again, and the index is only
+ * redone from E.vis_lo on, the rows above keep their visual lines. */
+void editorUpdateVisIndex(void) {
+    int j, lo = E.vis_lo, total;
+
+    if (E.vis_cols != E.textcols) lo = 0;
+    if (lo == INT_MAX) return;
+    if (lo > E.numrows) lo = E.numrows;
+    total = lo ? E.row[lo-1].vis+E.row[lo-1].nvis : 0;
+    for (j = lo; j < E.numrows; j++) {
+        erow *row = &E.row[j];
+        if (row->wrapcols != E.textcols) editorWrapRow(row);
+        row->vis = total;
+        total += row->nvis;
+    }
+    E.vis_row = realloc(E.vis_row,sizeof(int)*(total ? total : 1));
+    for (j = lo; j < E.numrows; j++) {
+        int k;
+        for (k = 0; k < E.row[j].nvis; k++)
+            E.vis_row[E.row[j].vis+k] = j;
+    }
+    E.numvis = total;
+    E.vis_cols = E.textcols;
+    E.vis_lo = INT_MAX;
+}
 
-#define ABUF_INIT {NULL,0}
+/* Return the render column of the char at 'filecol', expanding TABs the
+ * same way editorUpdateRow() does. */
+int editorRowCxToRx(erow *row, int filecol) {
+    int j, rx = 0;
+    for (j = 0; j < filecol; j++) {
+        if (j < row->size && row->chars[j] == TAB) {
+            rx++;
+            while((rx+1) % 8 != 0) rx++;
+        } else {
+            rx++;
+        }
+    }
+    return rx;
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-    char *new = realloc(ab->b,ab->len+len);
+/* Return the char index that is rendered at column 'rx'. */
+int editorRowRxToCx(erow *row, int rx) {
+    int cx, cur = 0;
+    for (cx = 0; cx < row->size; cx++) {
+        if (row->chars[cx] == TAB) {
+            cur++;
+            while((cur+1) % 8 != 0) cur++;
+        } else {
+            cur++;
+        }
+        if (cur > rx) return cx;
+    }
+    return cx;
+}
 
-    if (new == NULL) return;
-    memcpy(new+ab->len,s,len);
-    ab->b = new;
-    ab->len += len;
+/* Return the wrap segment of 'row' that contains render column 'rx'. */
+int editorRowSegment(erow *row, int rx) {
+    int seg = row->nvis-1;
+    while (seg > 0 && row->wrap[seg] > rx) seg--;
+    return seg;
 }
 
-void abFree(struct abuf *ab) {
-    free(ab->b);
+/* Return the visual line the cursor is on and store its column in '*vx'.
+ * Rows past the end of the file count as one visual line each. */
+int editorCursorVisual(int *vx) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+
+    if (filerow >= E.numrows) {
+        *vx = filecol;
+        return E.numvis+(filerow-E.numrows);
+    }
+    erow *row = &E.row[filerow];
+    int rx = editorRowCxToRx(row,filecol);
+    int seg = editorRowSegment(row,rx);
+    *vx = rx-row->wrap[seg];
+    return row->vis+seg;
 }
 
-void renderStatusLine(struct abuf *ab) {
-    char status[80], rstatus[80];
-    int len, rlen;
-    if(E.numrows > 0) {
-        len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-            E.filename, E.numrows, E.dirty ? "(modified)" : "");
-        rlen = snprintf(rstatus, sizeof(rstatus),
-            "%d/%d",E.rowoff+E.cy+1,E.numrows);
+/* Scroll E.vtop so the cursor is visible. In soft wrap mode the cursor is
+ * kept as an absolute position: E.rowoff is the cursor row and E.coloff
+ * is 0, so code written for the scrolling layout keeps working. */
+void editorScrollWrap(void) {
+    int vx, v;
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+
+    E.rowoff = filerow; E.cy = 0;
+    E.coloff = 0; E.cx = filecol;
+    editorUpdateVisIndex();
+    v = editorCursorVisual(&vx);
+    if (E.vtop > E.numvis) E.vtop = E.numvis;
+    if (v < E.vtop) E.vtop = v;
+    if (v >= E.vtop+E.screenrows) E.vtop = v-E.screenrows+1;
+}
+
+/* Move the cursor one visual line up or down, keeping its visual column. */
+void editorMoveVisual(int dir) {
+    int vx, v;
+
+    editorUpdateVisIndex();
+    v = editorCursorVisual(&vx)+dir;
+    if (v < 0 || v >= E.numvis) return;
+    erow *row = &E.row[E.vis_row[v]];
+    int seg = v-row->vis;
+    int start = row->wrap[seg];
+    int end = (seg+1 < row->nvis) ? row->wrap[seg+1]-1 : row->rsize;
+    int rx = start+vx;
+    if (rx > end) rx = end;
+    E.rowoff = row->idx; E.cy = 0;
+    E.coloff = 0; E.cx = editorRowRxToCx(row,rx);
+}
+
+/* Switch between soft wrap and horizontal scrolling, keeping the cursor
+ * row on screen. */
+void editorToggleSoftWrap(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+
+    E.softwrap = !E.softwrap;
+    if (E.softwrap) {
+        /* Start at the first visual line of the old top row. */
+        E.vis_cols = 0;
+        editorUpdateVisIndex();
+        E.vtop = (E.rowoff < E.numrows) ? E.row[E.rowoff].vis : E.numvis;
+        editorScrollWrap();
     } else {
-        len = snprintf(status, sizeof(status), "%.20s - empty", E.filename);
-        rlen = snprintf(rstatus, sizeof(rstatus), "-/-");
-    }
-    if (len > E.screencols) len = E.screencols;
-    abAppend(ab,status,len);
-    while(len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab,rstatus,rlen);
-            break;
+        E.rowoff = (E.vtop < E.numvis) ? E.vis_row[E.vtop] : filerow;
+        if (filerow < E.rowoff || filerow >= E.rowoff+E.screenrows)
+            E.rowoff = filerow;
+        E.cy = filerow-E.rowoff;
+        if (filecol >= E.textcols) {
+            E.coloff = filecol-E.textcols+1;
+            E.cx = E.textcols-1;
         } else {
-            abAppend(ab," ",1);
-            len++;
+            E.coloff = 0;
+            E.cx = filecol;
         }
     }
+    editorSetStatusMessage("Soft wrap %s", E.softwrap ? "on" : "off");
 }
 
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void editorRefreshScreen(void) {
-    int y;
-    erow *r;
-    char buf[32];
-    struct abuf ab = ABUF_INIT;
+/* ============================ Bracket matching ============================
+ *
+ * Every bracket outside strings and comments steps a nesting depth, '(',
+ * '[' and '{' up and their closing twins down. Each row caches the net
+ * change over the row and the lowest the depth gets within it, relative to
+ * the start of the row. The lowest point alone is enough in both directions:
+ * scanning right to left, the highest the depth climbs above the end of the
+ * row is br_net-br_min.
+ *
+ * Rows are further grouped in blocks, summarized the same way in a segment
+ * tree, so the block holding the match of a bracket is found walking
+ * O(log n) tree nodes instead of every row in between. Blocks start with
+ * BR_BLOCK rows and grow or shrink as rows are inserted and deleted, so an
+ * edit only makes its own block and the block's ancestors stale, and they
+ * are recomputed the next time the tree is used. A block grown past twice
+ * BR_BLOCK rows makes the whole tree be laid out again. */
+
+struct brNode {
+    int net;    /* Depth change over the node. */
+    int min;    /* Lowest depth reached, relative to the node start. */
+    int rows;   /* Rows under the node. */
+    char stale; /* The summary of the node, or of one below it, changed. */
+};
 
-    sys_txt_set_cursor_visible(chan_dev, 0);
+/* Return the depth step of render column 'i' of 'row': 1 for an opening
+ * bracket, -1 for a closing one, and 0 for anything else, including
+ * brackets inside strings and comments. */
+int brAt(erow *row, int i) {
+    int d;
 
-    // abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
-    abAppend(&ab,"\x1b[H",3); /* Go home. */
-    for (y = 0; y < E.screenrows; y++) {
-        int filerow = E.rowoff+y;
+    switch(row->render[i]) {
+    case '(': case '[': case '{': d = 1; break;
+    case ')': case ']': case '}': d = -1; break;
+    default: return 0;
+    }
+    return hlIsText(row,i) ? 0 : d;
+}
 
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && y == E.screenrows/3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome,sizeof(welcome),
-                    "Foenix Edit -- verison %s\x1b[0K\n", EDIT_VERSION);
-                int padding = (E.screencols-welcomelen)/2;
-                while(padding--) abAppend(&ab," ",1);
-                abAppend(&ab,welcome,welcomelen);
-            } else {
-                abAppend(&ab,"\x1b[0K\n",5);
-            }
-            continue;
-        }
+/* Recompute the bracket summary of a row after its highlight changed. */
+void editorUpdateBrackets(erow *row) {
+    int i, net = 0, min = 0;
 
-        r = &E.row[filerow];
+    for (i = 0; i < row->rsize; i++) {
+        net += brAt(row,i);
+        if (net < min) min = net;
+    }
+    if (net != row->br_net || min != row->br_min) {
+        row->br_net = net;
+        row->br_min = min;
+        brMark(row->idx,0);
+    }
+}
 
-        int len = r->rsize - E.coloff;
-        int current_color = -1;
-        if (len > 0) {
-            if (len >= E.screencols) len = E.screencols - 1;
-            char *c = r->render+E.coloff;
-            unsigned char *hl = r->hl+E.coloff;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (hl[j] == HL_NONPRINT) {
-                    char sym;
-                    //abAppend(&ab,"\x1b[7m",4);
-                    abAppend(&ab,"\x1b[30;47m",8);
-                    if (c[j] <= 26)
-                        sym = '@'+c[j];
-                    else
-                        sym = '?';
-                    abAppend(&ab,&sym,1);
-                    //abAppend(&ab,"\x1b[0m",4);
-                    abAppend(&ab,"\x1b[37;40m",8);
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        //abAppend(&ab,"\x1b[39m",5);
-                        abAppend(&ab,"\x1b[37;40m",8);
-                        current_color = -1;
-                    }
-                    abAppend(&ab,c+j,1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        char buf[16];
-                        int clen = snprintf(buf,sizeof(buf),"\x1b[%dm",color);
-                        current_color = color;
-                        abAppend(&ab,buf,clen);
-                    }
-                    abAppend(&ab,c+j,1);
-                }
-            }
+/* Tell the block tree about row 'at': 'delta' is 1 if it was just
+ * inserted, -1 if it is about to be deleted, 0 if its summary changed. */
+void brMark(int at, int delta) {
+    int n = 1;
+
+    if (E.br_size == 0 || E.br_rebuild) return;
+    while (1) {
+        E.br_tree[n].rows += delta;
+        E.br_tree[n].stale = 1;
+        if (n >= E.br_size) break;
+        n *= 2;
+        if (at >= E.br_tree[n].rows) {
+            at -= E.br_tree[n].rows;
+            n++;
         }
-        //abAppend(&ab,"\x1b[39m",5);
-        abAppend(&ab,"\x1b[37;40m",8);
-        abAppend(&ab,"\x1b[0K",4);
-        abAppend(&ab,"\n",1);
     }
+    if (E.br_tree[n].rows > BR_BLOCK*2) E.br_rebuild = 1;
+}
 
-    /* Create a two rows status. First row: */
-    abAppend(&ab,"\x1b[0K",4);
-    //abAppend(&ab,"\x1b[7m",4);
-    abAppend(&ab,"\x1b[30;47m",8);
-    renderStatusLine(&ab);
-    //abAppend(&ab,"\x1b[0m\n",5);
-    abAppend(&ab,"\x1b[37;40m",8);
-    /* Second row depends on E.statusmsg and the status message update time. */
-    abAppend(&ab,"\x1b[0K",4);
-    int msglen = strlen(E.statusmsg);
-    if (msglen && sys_time_jiffies()-E.statusmsg_time < 300)
-        abAppend(&ab,E.statusmsg,msglen <= E.screencols ? msglen : E.screencols);
+/* Return the block holding row 'at', and set '*first' to its first row. */
+int brBlockOf(int at, int *first) {
+    int n = 1;
+
+    *first = 0;
+    while (n < E.br_size) {
+        n *= 2;
+        if (at >= E.br_tree[n].rows) {
+            at -= E.br_tree[n].rows;
+            *first += E.br_tree[n].rows;
+            n++;
+        }
+    }
+    return n-E.br_size;
+}
 
-    /* Put cursor at its current position. Note that the horizontal position
-     * at which the cursor is displayed may be different compared to 'E.cx'
-     * because of TABs. */
-    int j;
-    int cx = 1;
-    int filerow = E.rowoff+E.cy;
-    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-    if (row) {
-        for (j = E.coloff; j < (E.cx+E.coloff); j++) {
-            if (j < row->size && row->chars[j] == TAB) cx += 7-((cx)%8);
-            cx++;
+/* Return the first row of block 'b'. */
+int brBlockStart(int b) {
+    int n, first = 0;
+
+    for (n = E.br_size+b; n > 1; n /= 2)
+        if (n & 1) first += E.br_tree[n-1].rows;
+    return first;
+}
+
+/* Recompute the stale nodes under node 'n', whose first row is 'first'. */
+void brUpdate(int n, int first) {
+    struct brNode *t = &E.br_tree[n], *l, *r;
+    int i;
+
+    if (!t->stale) return;
+    t->stale = 0;
+    if (n >= E.br_size) {
+        t->net = t->min = 0;
+        for (i = first; i < first+t->rows; i++) {
+            if (t->net+E.row[i].br_min < t->min)
+                t->min = t->net+E.row[i].br_min;
+            t->net += E.row[i].br_net;
         }
+        return;
     }
-    //snprintf(buf,sizeof(buf),"\x1b[%d;%dH",E.cy+1,cx);
-    abAppend(&ab,buf,strlen(buf));
-    //abAppend(&ab,"\x1b[?25h",6); /* Show cursor. */
-    sys_chan_write(0,(unsigned char *)ab.b,ab.len);
-    sys_txt_set_xy(chan_dev, cx-1, E.cy);
+    brUpdate(n*2,first);
+    brUpdate(n*2+1,first+E.br_tree[n*2].rows);
+    l = &E.br_tree[n*2];
+    r = &E.br_tree[n*2+1];
+    t->net = l->net+r->net;
+    t->min = (l->net+r->min < l->min) ? l->net+r->min : l->min;
+}
 
-#ifdef USE_CURSOR_GLYPH    
-    updateCursorGlyph();
-#endif
-    
-    sys_txt_set_cursor_visible(chan_dev, 1);
-    abFree(&ab);
+/* Bring the block tree up to date with the row summaries. */
+void brRefresh(void) {
+    int nblocks = (E.numrows+BR_BLOCK-1)/BR_BLOCK;
+    int size = 1, b, n;
+
+    if (E.br_size && !E.br_rebuild) {
+        brUpdate(1,0);
+        return;
+    }
+    /* Lay out blocks of BR_BLOCK rows. Rows added at the end of the file
+     * go to the empty blocks past the last. */
+    while (size < nblocks) size *= 2;
+    if (size != E.br_size) {
+        E.br_tree = realloc(E.br_tree,sizeof(struct brNode)*size*2);
+        E.br_size = size;
+    }
+    for (b = 0; b < size; b++) {
+        n = E.numrows-b*BR_BLOCK;
+        E.br_tree[size+b].rows = n < 0 ? 0 : n > BR_BLOCK ? BR_BLOCK : n;
+        E.br_tree[size+b].stale = 1;
+    }
+    for (n = size-1; n > 0; n--) {
+        E.br_tree[n].rows = E.br_tree[n*2].rows+E.br_tree[n*2+1].rows;
+        E.br_tree[n].stale = 1;
+    }
+    E.br_rebuild = 0;
+    brUpdate(1,0);
 }
 
-/* Set an editor status message for the second line of the status, at the
- * end of the screen. */
-void editorSetStatusMessage(const char *fmt, ...) {
-    va_list ap;
-    va_start(ap,fmt);
-    vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
-    va_end(ap);
-    E.statusmsg_time = sys_time_jiffies();
+/* Return the first block from 'b' on where '*depth' drops to zero, setting
+ * '*depth' to the depth at the start of that block, or -1 if there is no
+ * such block. */
+int brTreeForward(int b, int *depth) {
+    int n = E.br_size+b;
+
+    /* Climb, skipping whole subtrees that can't hold the match. */
+    while (*depth+E.br_tree[n].min > 0) {
+        *depth += E.br_tree[n].net;
+        while (n & 1) {
+            n /= 2;
+            if (n == 0) return -1;
+        }
+        n++;
+    }
+    /* Descend to the leftmost leaf holding the match. */
+    while (n < E.br_size) {
+        n *= 2;
+        if (*depth+E.br_tree[n].min > 0) {
+            *depth += E.br_tree[n].net;
+            n++;
+        }
+    }
+    return n-E.br_size;
 }
 
-/* =============================== Find mode ================================ */
+/* Like brTreeForward() but for blocks from 'b' down, scanning right to
+ * left, '*depth' being the count of closing brackets still unmatched. */
+int brTreeBackward(int b, int *depth) {
+    int n = E.br_size+b;
 
-#define KILO_QUERY_LEN 256
+    while (E.br_tree[n].net-E.br_tree[n].min < *depth) {
+        *depth -= E.br_tree[n].net;
+        while (!(n & 1)) n /= 2;
+        if (n == 1) return -1;
+        n--;
+    }
+    while (n < E.br_size) {
+        n = n*2+1;
+        if (E.br_tree[n].net-E.br_tree[n].min < *depth) {
+            *depth -= E.br_tree[n].net;
+            n--;
+        }
+    }
+    return n-E.br_size;
+}
 
-void editorFind() {
-    char query[KILO_QUERY_LEN+1] = {0};
-    int qlen = 0;
-    int last_match = -1; /* Last line where a match was found. -1 for none. */
-    int find_next = 0; /* if 1 search next, if -1 search prev. */
-    int saved_hl_line = -1;  /* No saved HL */
-    char *saved_hl = NULL;
-
-#define FIND_RESTORE_HL do { \
-    if (saved_hl) { \
-        memcpy(E.row[saved_hl_line].hl,saved_hl, E.row[saved_hl_line].rsize); \
-        free(saved_hl); \
-        saved_hl = NULL; \
-    } \
-} while (0)
+/* Scan 'row' from render column 'i' in direction 'dir' until '*depth'
+ * drops to zero. Return the column, or -1 if the row ends first. */
+int brScanRow(erow *row, int i, int dir, int *depth) {
+    for (; i >= 0 && i < row->rsize; i += dir) {
+        *depth -= brAt(row,i) * -dir;
+        if (*depth == 0) return i;
+    }
+    return -1;
+}
 
-    /* Save the cursor position in order to restore it later. */
-    int saved_cx = E.cx, saved_cy = E.cy;
-    int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
+/* Find the bracket matching the one at render column 'rx' of 'filerow',
+ * looking no further than rows 'minrow' to 'maxrow'. On success the match
+ * is stored in '*mrow' and '*mrx' and 1 is returned. 0 is returned if there
+ * is no bracket at 'rx', no match in range, or the match is of a different
+ * kind. Rows in range must be highlighted. */
+int editorMatchBracket(int filerow, int rx, int minrow, int maxrow,
+                       int *mrow, int *mrx) {
+    static const char *pairs = "()[]{}";
+    erow *row = &E.row[filerow];
+    int dir, depth = 1, tree, i, c = -1, b = 0, end = 0;
+    char *p;
 
-    while(1) {
-        editorSetStatusMessage(
-            "Search: %s (Use ESC/Arrows/Enter)", query);
-        editorRefreshScreen();
+    if (rx >= row->rsize || (dir = brAt(row,rx)) == 0) return 0;
+    /* The tree only pays off for a search through the whole file, it
+     * would have to be refreshed after every edit otherwise. */
+    tree = (minrow <= 0 && maxrow >= E.numrows-1);
+    if (tree) {
+        brRefresh();
+        b = brBlockOf(filerow,&end);
+        /* The row just past the block, in the scan direction. */
+        end = dir == 1 ? end+E.br_tree[E.br_size+b].rows : end-1;
+    }
 
-        int c = cli_getchar(0);
-        c = c & 0xFFFF;
-        if (c == BACKSPACE) {
-            if (qlen != 0) query[--qlen] = '\0';
-            last_match = -1;
-        } else if (c == ESC || c == ENTER) {
-            if (c == ESC) {
+    i = filerow;
+    c = brScanRow(row,rx+dir,dir,&depth);
+    while (c == -1) {
+        i += dir;
+        if (i < minrow || i > maxrow || i < 0 || i >= E.numrows) return 0;
+        row = &E.row[i];
+        /* Leaving the block of the bracket, let the tree find the one
+         * with the match. */
+        if (tree && i == end) {
+            tree = 0;
+            if (dir == 1) {
+                if ((b = brTreeForward(b+1,&depth)) == -1) return 0;
+                i = brBlockStart(b);
+            } else {
+                if ((b = brTreeBackward(b-1,&depth)) == -1) return 0;
+                i = brBlockStart(b)+E.br_tree[E.br_size+b].rows-1;
+            }
+            row = &E.row[i];
+        }
+        if (dir == 1 ? depth+row->br_min <= 0
+                     : row->br_net-row->br_min >= depth) {
+            c = brScanRow(row,dir == 1 ? 0 : row->rsize-1,dir,&depth);
+        } else {
+            depth += row->br_net*dir;
+        }
+    }
+
+    p = strchr(pairs,E.row[filerow].render[rx]);
+    if (row->render[c] != p[dir]) return 0;
+    *mrow = i;
+    *mrx = c;
+    return 1;
+}
+
+/* Return the render column of the bracket the cursor is on, or right
+ * after, or -1 if there is none. */
+int editorCursorBracket(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+    erow *row;
+
+    if (filerow >= E.numrows) return -1;
+    row = &E.row[filerow];
+    if (filecol < row->size && strchr("()[]{}",row->chars[filecol]))
+        return editorRowCxToRx(row,filecol);
+    if (filecol > 0 && filecol <= row->size &&
+        strchr("()[]{}",row->chars[filecol-1]))
+        return editorRowCxToRx(row,filecol-1);
+    return -1;
+}
+
+/* Mark the bracket at the cursor and its match with HL_BRACKET, when both
+ * are on screen. The rows changed and their saved highlight are stored in
+ * 'rows' and 'saved', to be put back with editorRestoreHighlight() once the
+ * screen is drawn. Return the number of rows changed. */
+int editorShowBracket(int *rows, struct hlSpan **saved) {
+    int filerow = E.rowoff+E.cy, first = E.rowoff, rx, mrow, mrx, n = 0;
+
+    if (E.softwrap)
+        first = (E.vtop < E.numvis) ? E.vis_row[E.vtop] : E.numrows;
+    if ((rx = editorCursorBracket()) == -1 ||
+        !editorMatchBracket(filerow,rx,first,editorLastVisibleRow(),
+                            &mrow,&mrx)) return 0;
+    rows[n] = filerow;
+    saved[n++] = editorSaveHighlight(&E.row[filerow]);
+    if (mrow != filerow) {
+        rows[n] = mrow;
+        saved[n++] = editorSaveHighlight(&E.row[mrow]);
+    }
+    hlFill(&E.row[filerow],rx,1,HL_BRACKET);
+    hlFill(&E.row[mrow],mrx,1,HL_BRACKET);
+    return n;
+}
+
+/* Move the cursor to char 'filecol' of 'filerow', scrolling only when the
+ * new position is off screen. */
+void editorSetCursor(int filerow, int filecol) {
+    if (E.softwrap) {
+        E.rowoff = filerow; E.cy = 0;
+        E.coloff = 0; E.cx = filecol;
+        editorScrollWrap();
+        return;
+    }
+    if (filerow < E.rowoff || filerow >= E.rowoff+E.screenrows) {
+        E.rowoff = filerow-E.screenrows/2;
+        if (E.rowoff < 0) E.rowoff = 0;
+    }
+    E.cy = filerow-E.rowoff;
+    if (filecol < E.coloff || filecol >= E.coloff+E.textcols)
+        E.coloff = (filecol >= E.textcols) ? filecol-E.textcols+1 : 0;
+    E.cx = filecol-E.coloff;
+}
+
+/* Jump to the bracket matching the one under the cursor, wherever it is
+ * in the file. */
+void editorJumpToBracket(void) {
+    int filerow = E.rowoff+E.cy;
+    int rx = editorCursorBracket(), mrow, mrx;
+
+    if (rx == -1) {
+        editorSetStatusMessage("No bracket under the cursor");
+        return;
+    }
+    editorSyntaxCatchUp(E.numrows-1);
+    if (!editorMatchBracket(filerow,rx,0,E.numrows-1,&mrow,&mrx)) {
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    editorSetCursor(mrow,editorRowRxToCx(&E.row[mrow],mrx));
+}
+
+/* ============================== Symbol index ==============================
+ *
+ * Rows that define a symbol keep a copy of its name in row->sym: function
+ * definitions in C, 'fun' and 'class' declarations in Lox, and line numbers
+ * in BASIC, that GOTO and GOSUB refer to. The lexer refreshes a row's
+ * symbol every time it highlights the row, so names in comments and strings
+ * are ignored and the index never needs a rescan of the file.
+ *
+ * E.syms holds the index of every row with a symbol, sorted by name then
+ * by row, so looking up a name or a prefix is a binary search. */
+
+#define SYM_MAX_LEN 32
+
+/* Callers pass plain chars, negative for bytes >= 0x80. */
+int isIdentChar(int c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Copy the C function defined by 'row' into 'name'. A definition starts at
+ * column 0 with its return type, and unlike a prototype or a declaration
+ * its first line doesn't end with ';' or ','. Return the name length, 0 if
+ * the row defines nothing. */
+int symFindC(erow *row, char *name) {
+    char *p = row->render;
+    int i, s, e, last = -1;
+
+    if (row->rsize == 0 || !(isalpha((unsigned char)p[0]) || p[0] == '_'))
+        return 0;
+    for (i = 0; i < row->rsize; i++) {
+        if (hlIsText(row,i)) continue;
+        if (p[i] == '=') return 0;
+        if (p[i] == '(') break;
+    }
+    if (i == row->rsize) return 0;
+    for (e = i; e > 0 && p[e-1] == ' '; e--);
+    for (s = e; s > 0 && isIdentChar(p[s-1]); s--);
+    if (s == e || isdigit((unsigned char)p[s]) ||
+        hlTypeAt(row,s) == HL_KEYWORD1) return 0;
+    for (i = 0; i < row->rsize; i++)
+        if (!isspace((unsigned char)p[i]) && !hlIsText(row,i)) last = i;
+    if (last < 0 || p[last] == ';' || p[last] == ',') return 0;
+    if (e-s > SYM_MAX_LEN) return 0;
+    memcpy(name,p+s,e-s);
+    return e-s;
+}
+
+/* Copy the name following the first 'fun' or 'class' keyword of 'row'. */
+int symFindLox(erow *row, char *name) {
+    char *p = row->render;
+    int j, i, s;
+
+    for (j = 0; j < row->nhl; j++) {
+        struct hlSpan *sp = &row->hl[j];
+        if (sp->hl != HL_KEYWORD1 ||
+            !((sp->len == 3 && !memcmp(p+sp->start,"fun",3)) ||
+              (sp->len == 5 && !memcmp(p+sp->start,"class",5)))) continue;
+        for (i = sp->start+sp->len; i < row->rsize && p[i] == ' '; i++);
+        for (s = i; i < row->rsize && isIdentChar(p[i]); i++);
+        if (i == s || isdigit((unsigned char)p[s]) || i-s > SYM_MAX_LEN)
+            return 0;
+        memcpy(name,p+s,i-s);
+        return i-s;
+    }
+    return 0;
+}
+
+/* Copy the line number of a BASIC row, without leading zeros, so it can be
+ * matched against a GOTO or GOSUB target. */
+int symFindBasic(erow *row, char *name) {
+    char *p = row->render;
+    int i, s;
+
+    for (i = 0; i < row->rsize && p[i] == ' '; i++);
+    for (s = i; i < row->rsize && isdigit((unsigned char)p[i]); i++);
+    if (i == s || (i < row->rsize && isIdentChar(p[i]))) return 0;
+    while (s < i-1 && p[s] == '0') s++;
+    if (i-s > SYM_MAX_LEN) return 0;
+    memcpy(name,p+s,i-s);
+    return i-s;
+}
+
+/* Compare the name 's' of row 'idx' with the k-th entry of the index. */
+int symCompare(const char *s, int idx, int k) {
+    int c = strcmp(s,E.row[E.syms[k]].sym);
+    return c ? c : idx-E.syms[k];
+}
+
+/* Return the position of the first index entry not below 's' of row
+ * 'idx'. Use an 'idx' of -1 to find the first entry named 's'. */
+int symSearch(const char *s, int idx) {
+    int lo = 0, hi = E.nsyms;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if (symCompare(s,idx,mid) > 0) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Add or remove the symbol of 'row' to or from the index. */
+void symAdd(erow *row) {
+    int k = symSearch(row->sym,row->idx);
+
+    E.syms = realloc(E.syms,sizeof(int)*(E.nsyms+1));
+    memmove(E.syms+k+1,E.syms+k,sizeof(int)*(E.nsyms-k));
+    E.syms[k] = row->idx;
+    E.nsyms++;
+}
+
+void symRemove(erow *row) {
+    int k = symSearch(row->sym,row->idx);
+
+    memmove(E.syms+k,E.syms+k+1,sizeof(int)*(E.nsyms-k-1));
+    E.nsyms--;
+}
+
+/* Renumber the index after rows were inserted or deleted at 'at'. */
+void symShift(int at, int delta) {
+    int k;
+    for (k = 0; k < E.nsyms; k++)
+        if (E.syms[k] >= at) E.syms[k] += delta;
+}
+
+/* Refresh the symbol of a row after its highlight changed. */
+void editorUpdateSymbol(erow *row) {
+    char name[SYM_MAX_LEN+1];
+    int len = 0, flags = E.syntax ? E.syntax->flags : 0;
+
+    if (flags & HL_SYMBOLS_C) len = symFindC(row,name);
+    else if (flags & HL_SYMBOLS_LOX) len = symFindLox(row,name);
+    else if (flags & HL_SYMBOLS_BASIC) len = symFindBasic(row,name);
+    if (len > SYM_MAX_LEN) len = 0;
+    name[len] = '\0';
+
+    if (row->sym && len && !strcmp(row->sym,name)) return;
+    if (row->sym) {
+        symRemove(row);
+        free(row->sym);
+        row->sym = NULL;
+    }
+    if (len) {
+        row->sym = strdup(name);
+        symAdd(row);
+    }
+}
+
+/* Return the row defining 'name', or -1 if there is none. */
+int editorFindSymbol(const char *name) {
+    int k;
+
+    editorSyntaxCatchUp(E.numrows-1);
+    k = symSearch(name,-1);
+    if (k < E.nsyms && !strcmp(E.row[E.syms[k]].sym,name)) return E.syms[k];
+    return -1;
+}
+
+/* Jump to the definition of the word under the cursor. On a BASIC GOTO or
+ * GOSUB the target line number is used. */
+void editorGotoDefinition(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+    char name[SYM_MAX_LEN+1];
+    int s, e, row;
+    erow *r;
+
+    if (filerow >= E.numrows) return;
+    r = &E.row[filerow];
+    for (s = filecol; s > 0 && s <= r->size && isIdentChar(r->chars[s-1]); s--);
+    for (e = s; e < r->size && isIdentChar(r->chars[e]); e++);
+    if ((e-s == 4 && !strncasecmp(r->chars+s,"GOTO",4)) ||
+        (e-s == 5 && !strncasecmp(r->chars+s,"GOSUB",5))) {
+        for (s = e; s < r->size && r->chars[s] == ' '; s++);
+        for (e = s; e < r->size && isdigit((unsigned char)r->chars[e]); e++);
+    }
+    if (s < e && isdigit((unsigned char)r->chars[s]))
+        while (s < e-1 && r->chars[s] == '0') s++;
+    if (s == e || e-s > SYM_MAX_LEN) {
+        editorSetStatusMessage("No name under the cursor");
+        return;
+    }
+    memcpy(name,r->chars+s,e-s);
+    name[e-s] = '\0';
+    if ((row = editorFindSymbol(name)) == -1) {
+        editorSetStatusMessage("No definition of %s",name);
+        return;
+    }
+    editorSetCursor(row,0);
+}
+
+/* ============================= Terminal update ============================ */
+
+/* We define a very simple "append buffer" structure, that is an heap
+ * allocated string where we can append to. This is useful in order to
+ * write all the escape sequences in a buffer and flush them to the standard
+ * output in a single call, to avoid flickering effects. */
+struct abuf {
+    char *b;
+    int len;
+};
+
+#define ABUF_INIT {NULL,0}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+    char *new = realloc(ab->b,ab->len+len);
+
+    if (new == NULL) return;
+    memcpy(new+ab->len,s,len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void abFree(struct abuf *ab) {
+    free(ab->b);
+}
+
+/* Switch the terminal to attribute 'attr', emitting the SGR sequence only
+ * when it differs from the attribute '*cur' the terminal is already in. */
+void abAppendAttr(struct abuf *ab, int *cur, int attr) {
+    if (*cur == attr) return;
+    if (*cur != ATTR_NONE && ATTR_ON_BLACK(*cur) && ATTR_ON_BLACK(attr)) {
+        abAppend(ab,attrToSGR[attr],SGR_FG_LEN);
+        abAppend(ab,"m",1);
+    } else {
+        abAppend(ab,attrToSGR[attr],SGR_LEN);
+    }
+    *cur = attr;
+}
+
+/* Append the status bar, rebuilding the cached copy only when something it
+ * shows (file name, line count, dirty flag, cursor line) has changed. */
+void renderStatusLine(struct abuf *ab) {
+    int line = E.rowoff+E.cy+1;
+    int dirty = E.dirty != 0;
+
+    if (E.statusbar == NULL || E.sb_filename != E.filename ||
+        E.sb_numrows != E.numrows || E.sb_dirty != dirty ||
+        E.sb_line != line || E.sb_cols != E.screencols)
+    {
+        char status[80], rstatus[80];
+        int len, rlen;
+        if(E.numrows > 0) {
+            len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                E.filename, E.numrows, dirty ? "(modified)" : "");
+            rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",line,E.numrows);
+        } else {
+            len = snprintf(status, sizeof(status), "%.20s - empty", E.filename);
+            rlen = snprintf(rstatus, sizeof(rstatus), "-/-");
+        }
+        if (len > E.screencols) len = E.screencols;
+
+        free(E.statusbar);
+        E.statusbar = malloc(E.screencols);
+        memset(E.statusbar,' ',E.screencols);
+        memcpy(E.statusbar,status,len);
+        if (len + rlen <= E.screencols)
+            memcpy(E.statusbar+E.screencols-rlen,rstatus,rlen);
+
+        E.sb_filename = E.filename;
+        E.sb_numrows = E.numrows;
+        E.sb_dirty = dirty;
+        E.sb_line = line;
+        E.sb_cols = E.screencols;
+    }
+    abAppend(ab,E.statusbar,E.screencols);
+}
+
+/* Resize the line number gutter when the line count gains or loses a digit,
+ * so the width follows E.numrows without counting digits on every frame. */
+void editorUpdateGutter(void) {
+    int width = E.gutter;
+
+    if (!E.linenums) {
+        width = 0;
+    } else if (E.gutter == 0 || E.numrows >= E.gutter_limit ||
+               (E.gutter_limit > 10 && E.numrows < E.gutter_limit/10)) {
+        int digits = 1, limit = 10;
+        while (E.numrows >= limit) {
+            digits++;
+            limit *= 10;
+        }
+        E.gutter_limit = limit;
+        width = digits+1; /* One space separates the number from the text. */
+    }
+    if (width != E.gutter) {
+        E.gutter = width;
+        E.gutter_top = 0; /* Digits must be formatted again. */
+    }
+    E.textcols = E.screencols - E.gutter;
+
+    /* Keep the cursor inside the text area if the gutter grew. */
+    if (E.cx > E.textcols-1) {
+        E.coloff += E.cx-(E.textcols-1);
+        E.cx = E.textcols-1;
+    }
+}
+
+/* Gutter of a wrapped continuation line. */
+static const char gutterBlank[sizeof(E.gutter_digits)+1] = "            ";
+
+/* Write 'n' right aligned into the 'w' gutter digits 'd'. */
+void gutterFormat(char *d, int w, int n) {
+    memset(d,' ',w);
+    do {
+        d[--w] = '0'+n%10;
+        n /= 10;
+    } while (n && w > 0);
+}
+
+/* Add one to the gutter digits in place, carrying like an odometer. */
+void gutterIncrement(char *d, int w) {
+    int i = w-1;
+    while (i >= 0 && d[i] == '9') d[i--] = '0';
+    if (i >= 0) d[i] = (d[i] == ' ') ? '1' : d[i]+1;
+}
+
+/* Subtract one from the gutter digits in place, blanking a leading zero. */
+void gutterDecrement(char *d, int w) {
+    int i = w-1;
+    while (i >= 0 && d[i] == '0') d[i--] = '9';
+    if (i < 0) return;
+    d[i]--;
+    if (d[i] == '0' && i != w-1 && (i == 0 || d[i-1] == ' ')) d[i] = ' ';
+}
+
+/* Bring E.gutter_digits in line with 'top', the number of the first row
+ * labelled on screen. Scrolling by a single line steps the digits instead
+ * of formatting the number again. */
+void editorUpdateGutterTop(int top) {
+    int w = E.gutter-1;
+
+    if (E.gutter_top == top) return;
+    if (E.gutter_top && E.gutter_top == top-1)
+        gutterIncrement(E.gutter_digits,w);
+    else if (E.gutter_top && E.gutter_top == top+1)
+        gutterDecrement(E.gutter_digits,w);
+    else
+        gutterFormat(E.gutter_digits,w,top);
+    E.gutter_top = top;
+}
+
+/* Append 'len' rendered characters of row 'r' starting at 'start'. The
+ * 'nov' spans at 'ov' are drawn over the row's own highlight. */
+void abAppendRow(struct abuf *ab, int *attr, erow *r, int start, int len,
+                 struct hlSpan *ov, int nov) {
+    struct hlSpan *sp = r->hl, *spend = r->hl+r->nhl, *ovend = ov+nov;
+    char *c = r->render;
+    int j = start, end = start+len;
+
+    while (j < end) {
+        /* Emit a whole span, or the HL_NORMAL gap before the next one,
+         * with a single SGR change and a single append. */
+        int h = HL_NORMAL, k = end;
+
+        /* Skip the spans that end before the next character drawn. */
+        while (sp < spend && sp->start+sp->len <= j) sp++;
+        while (ov < ovend && ov->start+ov->len <= j) ov++;
+        if (ov < ovend && ov->start <= j) {
+            h = ov->hl;
+            if (ov->start+ov->len < end) k = ov->start+ov->len;
+        } else {
+            if (sp < spend && sp->start <= j) {
+                h = sp->hl;
+                if (sp->start+sp->len < end) k = sp->start+sp->len;
+            } else if (sp < spend && sp->start < end) {
+                k = sp->start;
+            }
+            if (ov < ovend && ov->start < k) k = ov->start;
+        }
+        abAppendAttr(ab,attr,hlToAttr[h]);
+        if (hlToAttr[h] == ATTR_INVERSE) {
+            for (; j < k; j++) {
+                char sym = (c[j] <= 26) ? '@'+c[j] : '?';
+                abAppend(ab,&sym,1);
+            }
+        } else {
+            abAppend(ab,c+j,k-j);
+        }
+        j = k;
+    }
+}
+
+/* This function writes the whole screen using VT100 escape characters
+ * starting from the logical state of the editor in the global state 'E'. */
+void editorRefreshScreen(void) {
+    int y;
+    erow *r;
+    int attr = ATTR_NONE; /* Attribute the terminal is currently in. */
+    char linenum[sizeof(E.gutter_digits)+1];
+    struct abuf ab = ABUF_INIT;
+    int brrows[2], nbr;
+    struct hlSpan *brsaved[2];
+
+    sys_txt_set_cursor_visible(chan_dev, 0);
+
+    editorUpdateGutter();
+    if (E.softwrap) editorScrollWrap();
+    editorSyntaxCatchUp(editorLastVisibleRow());
+    nbr = editorShowBracket(brrows,brsaved);
+    /* Search matches are only kept for the rows on screen. */
+    y = E.rowoff;
+    if (E.softwrap) y = (E.vtop < E.numvis) ? E.vis_row[E.vtop] : E.numrows;
+    matchCacheView(y,editorLastVisibleRow());
+    if (E.gutter) {
+        /* Each labelled row steps a local copy of the first label. */
+        int top = E.rowoff+1;
+        if (E.softwrap) {
+            top = E.numrows+1;
+            if (E.vtop < E.numvis) {
+                r = &E.row[E.vis_row[E.vtop]];
+                top = r->idx + (r->vis == E.vtop ? 1 : 2);
+            }
+        }
+        editorUpdateGutterTop(top);
+        memcpy(linenum,E.gutter_digits,E.gutter-1);
+        linenum[E.gutter-1] = ' ';
+    }
+
+    // abAppend(&ab,"\x1b[?25l",6); /* Hide cursor. */
+    abAppend(&ab,"\x1b[H",3); /* Go home. */
+    for (y = 0; y < E.screenrows; y++) {
+        int filerow = E.rowoff+y;
+        int start = E.coloff, end = -1, label = 1;
+
+        if (E.softwrap) {
+            /* Draw one wrap segment, only the first one gets a label. */
+            int v = E.vtop+y;
+            filerow = (v < E.numvis) ? E.vis_row[v] : E.numrows;
+            if (filerow < E.numrows) {
+                int seg;
+                r = &E.row[filerow];
+                seg = v-r->vis;
+                start = r->wrap[seg];
+                if (seg+1 < r->nvis) end = r->wrap[seg+1];
+                label = (seg == 0);
+            }
+        }
+
+        if (filerow >= E.numrows) {
+            abAppendAttr(&ab,&attr,ATTR_NORMAL);
+            if (E.numrows == 0 && y == E.screenrows/3) {
+                char welcome[80];
+                int welcomelen = snprintf(welcome,sizeof(welcome),
+                    "Foenix Edit -- verison %s\x1b[0K\n", EDIT_VERSION);
+                int padding = (E.screencols-welcomelen)/2;
+                while(padding--) abAppend(&ab," ",1);
+                abAppend(&ab,welcome,welcomelen);
+            } else {
+                abAppend(&ab,"\x1b[0K\n",5);
+            }
+            continue;
+        }
+
+        r = &E.row[filerow];
+
+        if (E.gutter) {
+            abAppendAttr(&ab,&attr,ATTR_NORMAL);
+            if (label) {
+                abAppend(&ab,linenum,E.gutter);
+                gutterIncrement(linenum,E.gutter-1);
+            } else {
+                abAppend(&ab,gutterBlank,E.gutter);
+            }
+        }
+
+        int len = (end == -1 ? r->rsize : end) - start;
+        if (len > 0) {
+            struct hlSpan *ov;
+            int nov;
+            if (len >= E.textcols) len = E.textcols - 1;
+            ov = matchCacheRow(filerow,&nov);
+            abAppendRow(&ab,&attr,r,start,len,ov,nov);
+        }
+        /* Only the background matters for the erase, so any attribute on
+         * the black background may carry over to the next row. */
+        if (attr == ATTR_NONE || !ATTR_ON_BLACK(attr))
+            abAppendAttr(&ab,&attr,ATTR_NORMAL);
+        abAppend(&ab,"\x1b[0K\n",5);
+    }
+    while (nbr--) editorRestoreHighlight(&E.row[brrows[nbr]],brsaved[nbr]);
+
+    /* Create a two rows status. First row: */
+    abAppendAttr(&ab,&attr,ATTR_NORMAL);
+    abAppend(&ab,"\x1b[0K",4);
+    abAppendAttr(&ab,&attr,ATTR_INVERSE);
+    renderStatusLine(&ab);
+    abAppendAttr(&ab,&attr,ATTR_NORMAL);
+    /* Second row shows E.statusmsg until its deadline passes. Once expired
+     * the length drops to zero and the clock is no longer consulted. */
+    abAppend(&ab,"\x1b[0K",4);
+    if (E.statusmsglen && sys_time_jiffies() >= E.statusmsg_deadline)
+        E.statusmsglen = 0;
+    if (E.statusmsglen)
+        abAppend(&ab,E.statusmsg,E.statusmsglen <= E.screencols ?
+                                 E.statusmsglen : E.screencols);
+
+    /* Put cursor at its current position. Note that the horizontal position
+     * at which the cursor is displayed may be different compared to 'E.cx'
+     * because of TABs. */
+    int j;
+    int cx = 1, cy = E.cy;
+    int filerow = E.rowoff+E.cy;
+    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+    if (E.softwrap) {
+        int vx;
+        cy = editorCursorVisual(&vx)-E.vtop;
+        cx = vx+1;
+    } else if (row) {
+        for (j = E.coloff; j < (E.cx+E.coloff); j++) {
+            if (j < row->size && row->chars[j] == TAB) cx += 7-((cx)%8);
+            cx++;
+        }
+    }
+    //snprintf(buf,sizeof(buf),"\x1b[%d;%dH",E.cy+1,cx);
+    //abAppend(&ab,"\x1b[?25h",6); /* Show cursor. */
+    sys_chan_write(0,(unsigned char *)ab.b,ab.len);
+    sys_txt_set_xy(chan_dev, E.gutter+cx-1, cy);
+
+#ifdef USE_CURSOR_GLYPH    
+    updateCursorGlyph();
+#endif
+    
+    sys_txt_set_cursor_visible(chan_dev, 1);
+    abFree(&ab);
+}
+
+/* Set an editor status message for the second line of the status, at the
+ * end of the screen. The message is shown for EDIT_STATUSMSG_JIFFIES. */
+#define EDIT_STATUSMSG_JIFFIES 300
+void editorSetStatusMessage(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap,fmt);
+    vsnprintf(E.statusmsg,sizeof(E.statusmsg),fmt,ap);
+    va_end(ap);
+    E.statusmsglen = strlen(E.statusmsg);
+    E.statusmsg_deadline = sys_time_jiffies() + EDIT_STATUSMSG_JIFFIES;
+}
+
+/* ====================== Loadable syntax definitions =======================
+ *
+ * Besides the built in languages above, a syntax can be described in a
+ * text file in EDIT_SYNTAX_DIR, one language per "*.syn" file:
+ *
+ *   # Comment lines and blank lines are ignored.
+ *   extensions .asm .s
+ *   interpreter asm.pgz
+ *   keywords move add sub jmp bra
+ *   keywords byte| word| long|
+ *   comment ;;
+ *   mlcomment (* *)
+ *   flags strings numbers
+ *   symbols c
+ *
+ * 'symbols' picks the definitions indexed for Ctrl+O: c, lox or basic.
+ * Every directive but 'extensions' is optional and 'keywords' may repeat.
+ * Comment delimiters follow the same two character rule as the built in
+ * syntaxes.
+ *
+ * Parsing text from the SD card at every launch would be slow, so the first
+ * launch compiles all the definitions into EDIT_SYNTAX_CACHE, a binary image
+ * that later launches read with a single sys_fsys_load(). The image is used
+ * in place: extensions, keywords and delimiters point straight into it, only
+ * the lexer and keyword tables are rebuilt by addSyntax(). Delete the cache
+ * after editing a definition so it gets compiled again. */
+
+#define EDIT_SYNTAX_DIR "/sd/edit/syntax"
+#define EDIT_SYNTAX_CACHE "/sd/edit/syntax.bin"
+#define SYN_MAGIC "FESY"
+#define SYN_VERSION 1
+#define SYN_MAX_EXT 8   /* Extensions per definition file. */
+
+/* Layout of the cache image. Offsets are from the start of the image, and
+ * every string is nul terminated. The header is followed by 'count' entries,
+ * the keyword offset lists and the strings. Entries and lists are long
+ * aligned so the image can be used right where it was loaded. */
+struct synHeader {
+    char magic[4];
+    unsigned short version;
+    unsigned short count;       /* Number of synEntry records. */
+    unsigned long size;         /* Size of the whole image. */
+};
+
+struct synEntry {
+    unsigned long extension;    /* Offset of the extension string. */
+    unsigned long interpreter;  /* Offset of the interpreter string. */
+    unsigned long keywords;     /* Offset of nkeywords string offsets. */
+    unsigned short nkeywords;
+    unsigned short flags;       /* HL_HIGHLIGHT_* */
+    char singleline_comment_start[2];
+    char multiline_comment_start[3];
+    char multiline_comment_end[3];
+};
+
+/* A definition file being compiled. Strings are offsets into the pool. */
+struct synSource {
+    char *ext[SYN_MAX_EXT];
+    int numext;
+    char *interpreter;
+    char **keywords;
+    int nkeywords;
+    char scs[2], mcs[3], mce[3];
+    int flags;
+};
+
+/* Append a nul terminated string to the image, returning its offset. */
+unsigned long synAppendString(struct abuf *ab, const char *s) {
+    unsigned long off = ab->len;
+    abAppend(ab,s,strlen(s)+1);
+    return off;
+}
+
+/* Pad the image with zeros to a long boundary. */
+void synAlign(struct abuf *ab) {
+    static const char zero[sizeof(long)] = {0};
+    if (ab->len % sizeof(long))
+        abAppend(ab,zero,sizeof(long) - ab->len % sizeof(long));
+}
+
+/* Copy a comment delimiter of exactly two characters into 'dst'. */
+void synDelimiter(char *dst, const char *tok) {
+    if (tok && strlen(tok) == 2) memcpy(dst,tok,2);
+}
+
+/* Parse one definition file into 'src'. Return 0 on success, or -1 if the
+ * file can't be read or names no extension. */
+int synParseFile(const char *path, struct synSource *src) {
+    FILE *fp = fopen(path,"r");
+    char *line = NULL, *tok;
+    size_t linecap = 0;
+    const char *sep = " \t\r\n";
+
+    memset(src,0,sizeof(*src));
+    if (fp == NULL) return -1;
+    while (getline(&line,&linecap,fp) != -1) {
+        char *key = strtok(line,sep);
+
+        if (key == NULL || key[0] == '#') continue;
+        if (!strcmp(key,"extensions")) {
+            while ((tok = strtok(NULL,sep)) && src->numext < SYN_MAX_EXT)
+                src->ext[src->numext++] = strdup(tok);
+        } else if (!strcmp(key,"interpreter")) {
+            if ((tok = strtok(NULL,sep)) && !src->interpreter)
+                src->interpreter = strdup(tok);
+        } else if (!strcmp(key,"keywords")) {
+            while ((tok = strtok(NULL,sep))) {
+                src->keywords = realloc(src->keywords,
+                    sizeof(char*)*(src->nkeywords+1));
+                src->keywords[src->nkeywords++] = strdup(tok);
+            }
+        } else if (!strcmp(key,"comment")) {
+            synDelimiter(src->scs,strtok(NULL,sep));
+        } else if (!strcmp(key,"mlcomment")) {
+            synDelimiter(src->mcs,strtok(NULL,sep));
+            synDelimiter(src->mce,strtok(NULL,sep));
+        } else if (!strcmp(key,"symbols")) {
+            if (!(tok = strtok(NULL,sep))) continue;
+            if (!strcmp(tok,"c")) src->flags |= HL_SYMBOLS_C;
+            else if (!strcmp(tok,"lox")) src->flags |= HL_SYMBOLS_LOX;
+            else if (!strcmp(tok,"basic")) src->flags |= HL_SYMBOLS_BASIC;
+        } else if (!strcmp(key,"flags")) {
+            while ((tok = strtok(NULL,sep))) {
+                if (!strcmp(tok,"strings")) src->flags |= HL_HIGHLIGHT_STRINGS;
+                else if (!strcmp(tok,"numbers"))
+                    src->flags |= HL_HIGHLIGHT_NUMBERS;
+            }
+        }
+    }
+    free(line);
+    fclose(fp);
+    return src->numext ? 0 : -1;
+}
+
+void synFreeSource(struct synSource *src) {
+    int j;
+    for (j = 0; j < src->numext; j++) free(src->ext[j]);
+    for (j = 0; j < src->nkeywords; j++) free(src->keywords[j]);
+    free(src->keywords);
+    free(src->interpreter);
+}
+
+/* Append the entries of 'src' to the image. Entries are reserved up front
+ * by the caller, 'entry' is the offset of the first one to fill in. */
+void synEmitSource(struct abuf *ab, unsigned long entry,
+                   struct synSource *src) {
+    unsigned long kwlist, interp, *offs;
+    struct synEntry *e;
+    int j;
+
+    synAlign(ab);
+    kwlist = ab->len;
+    offs = calloc(src->nkeywords+1,sizeof(unsigned long));
+    abAppend(ab,(char*)offs,sizeof(unsigned long)*src->nkeywords);
+    for (j = 0; j < src->nkeywords; j++)
+        offs[j] = synAppendString(ab,src->keywords[j]);
+    memcpy(ab->b+kwlist,offs,sizeof(unsigned long)*src->nkeywords);
+    free(offs);
+    interp = synAppendString(ab,src->interpreter ? src->interpreter : "");
+
+    /* All the extensions of a file share its keywords and delimiters. */
+    for (j = 0; j < src->numext; j++) {
+        unsigned long ext = synAppendString(ab,src->ext[j]);
+
+        e = (struct synEntry*)(ab->b+entry+j*sizeof(struct synEntry));
+        e->extension = ext;
+        e->interpreter = interp;
+        e->keywords = kwlist;
+        e->nkeywords = src->nkeywords;
+        e->flags = src->flags;
+        memcpy(e->singleline_comment_start,src->scs,2);
+        memcpy(e->multiline_comment_start,src->mcs,3);
+        memcpy(e->multiline_comment_end,src->mce,3);
+    }
+}
+
+/* Compile every "*.syn" file of EDIT_SYNTAX_DIR into a cache image. The
+ * image is returned in 'ab', empty if there is nothing to compile. */
+void editorCompileSyntaxDefs(struct abuf *ab) {
+    struct synSource *src = NULL;
+    struct synHeader hdr;
+    t_file_info info;
+    char path[MAX_PATH_LEN];
+    int numsrc = 0, count = 0, j;
+    unsigned long entry;
+    short dir;
+
+    dir = sys_fsys_findfirst(EDIT_SYNTAX_DIR,"*.syn",&info);
+    if (dir < 0) return;
+    do {
+        if (info.name[0] == '\0') break;
+        snprintf(path,sizeof(path),"%s/%s",EDIT_SYNTAX_DIR,info.name);
+        src = realloc(src,sizeof(struct synSource)*(numsrc+1));
+        if (synParseFile(path,&src[numsrc]) == 0) {
+            count += src[numsrc].numext;
+            numsrc++;
+        } else {
+            synFreeSource(&src[numsrc]);
+        }
+    } while (sys_fsys_findnext(dir,&info) >= 0);
+    sys_fsys_closedir(dir);
+
+    if (count) {
+        memset(&hdr,0,sizeof(hdr));
+        abAppend(ab,(char*)&hdr,sizeof(hdr));
+        synAlign(ab);
+        entry = ab->len;
+        for (j = 0; j < count; j++) {
+            struct synEntry e;
+            memset(&e,0,sizeof(e));
+            abAppend(ab,(char*)&e,sizeof(e));
+        }
+        for (j = 0; j < numsrc; j++) {
+            synEmitSource(ab,entry,&src[j]);
+            entry += src[j].numext*sizeof(struct synEntry);
+        }
+        memcpy(hdr.magic,SYN_MAGIC,4);
+        hdr.version = SYN_VERSION;
+        hdr.count = count;
+        hdr.size = ab->len;
+        memcpy(ab->b,&hdr,sizeof(hdr));
+    }
+    for (j = 0; j < numsrc; j++) synFreeSource(&src[j]);
+    free(src);
+}
+
+/* Register the syntaxes of a cache image of 'size' bytes. The image must
+ * stay allocated, as the syntaxes reference it. Return 0 on success or -1
+ * if the image is not a valid cache. */
+int editorAddSyntaxImage(char *img, unsigned long size) {
+    struct synHeader *hdr = (struct synHeader*)img;
+    struct synEntry *e;
+    unsigned long first;
+    int j, k;
+
+    if (size < sizeof(*hdr) || memcmp(hdr->magic,SYN_MAGIC,4) ||
+        hdr->version != SYN_VERSION || hdr->size != size) return -1;
+    first = (sizeof(*hdr)+sizeof(long)-1)/sizeof(long)*sizeof(long);
+    if (first+hdr->count*sizeof(struct synEntry) > size) return -1;
+
+    /* Validate everything before registering anything. */
+    e = (struct synEntry*)(img+first);
+    for (j = 0; j < hdr->count; j++) {
+        unsigned long *offs = (unsigned long*)(img+e[j].keywords);
+        if (e[j].extension >= size || e[j].interpreter >= size ||
+            e[j].keywords % sizeof(long) ||
+            e[j].keywords+e[j].nkeywords*sizeof(long) > size) return -1;
+        for (k = 0; k < e[j].nkeywords; k++)
+            if (offs[k] >= size) return -1;
+    }
+    if (img[size-1] != '\0') return -1;
+
+    for (j = 0; j < hdr->count; j++) {
+        struct editorSyntax *syn = calloc(1,sizeof(*syn));
+        unsigned long *offs = (unsigned long*)(img+e[j].keywords);
+
+        syn->extension = img+e[j].extension;
+        syn->interpreter = img+e[j].interpreter;
+        syn->keywords = malloc(sizeof(char*)*(e[j].nkeywords+1));
+        for (k = 0; k < e[j].nkeywords; k++)
+            syn->keywords[k] = img+offs[k];
+        syn->keywords[k] = NULL;
+        memcpy(syn->singleline_comment_start,e[j].singleline_comment_start,2);
+        memcpy(syn->multiline_comment_start,e[j].multiline_comment_start,3);
+        memcpy(syn->multiline_comment_end,e[j].multiline_comment_end,3);
+        syn->flags = e[j].flags;
+        addSyntax(syn);
+    }
+    return 0;
+}
+
+/* Load the syntax definitions from the SD card, from the compiled cache if
+ * there is a valid one, otherwise compiling the text definitions and saving
+ * the result as the new cache. Loaded syntaxes take precedence over the
+ * built in ones for the same extension. */
+void editorLoadSyntaxDefs(void) {
+    struct abuf ab = ABUF_INIT;
+    t_file_info info;
+    long start;
+    FILE *fp;
+
+    if (sys_fsys_stat(EDIT_SYNTAX_CACHE,&info) == 0 && info.size > 0) {
+        char *img = malloc(info.size);
+        if (img && sys_fsys_load(EDIT_SYNTAX_CACHE,(long)img,&start) == 0 &&
+            editorAddSyntaxImage(img,info.size) == 0) return;
+        free(img);
+    }
+
+    editorCompileSyntaxDefs(&ab);
+    if (ab.len == 0) return;
+    if (editorAddSyntaxImage(ab.b,ab.len) != 0) {
+        abFree(&ab);
+        return;
+    }
+    fp = fopen(EDIT_SYNTAX_CACHE,"w");
+    if (fp) {
+        fwrite(ab.b,1,ab.len,fp);
+        fclose(fp);
+    }
+}
+
+/* =========================== Regular expressions ==========================
+ *
+ * Supported syntax: literal chars, '.', bracket classes with ranges and
+ * negation ("[a-z_]", "[^0-9]"), the escapes \d \w \s, '\' before any other
+ * char to take it literally, the anchors '^' and '$', alternation '|',
+ * grouping with parentheses and the repetitions '*', '+' and '?'.
+ *
+ * A query is parsed into a tree, then compiled into a Thompson NFA program.
+ * Rows are never matched by backtracking: the NFA is simulated by a DFA that
+ * is built lazily, one state per set of NFA threads, as bytes are consumed.
+ * Bytes that every set of the program treats alike share one column of the
+ * transition table, so a state costs a few dozen bytes rather than 256
+ * entries. At most RX_DFA_STATES states are cached; a pattern needing more
+ * flushes the cache and rebuilds states as it goes, so memory stays bounded
+ * and time stays linear in the row length.
+ *
+ * The DFA tells where a match ends, not where it starts, so the program is
+ * also compiled reversed: run backwards from the end of the matches, it
+ * finds their leftmost start without trying the offsets one by one. */
+
+#define RX_SET 0        /* Consume a byte of set x. */
+#define RX_SPLIT 1      /* Continue at both x and y. */
+#define RX_JMP 2        /* Continue at x. */
+#define RX_BOL 3        /* Only at the start of the row. */
+#define RX_EOL 4        /* Only at the end of the row. */
+#define RX_MATCH 5
+
+#define RX_DFA_STATES 64
+#define RX_UNKNOWN -1   /* Transition not computed yet. */
+#define RX_DEAD -2      /* No thread survives. */
+
+/* Where a match may begin, see rxStart(). */
+#define RX_ANCHORED 0   /* At the first byte only. */
+#define RX_UNANCHORED 1 /* At any byte. */
+#define RX_WORD 2       /* At the first byte, or after a non word byte. */
+#define RX_WORD_SKIP 3  /* Only after a non word byte. */
+
+#define RX_ACCEPT 1         /* State matches here. */
+#define RX_ACCEPT_EOL 2     /* State matches if the row ends here. */
+#define RX_ACCEPT_EMPTY 4   /* State matches if the row is empty. */
+
+/* Does state 'st' match at offset 'i' of a row of 'len' bytes? */
+#define RX_ACCEPTS(rx,st,i,len) ((rx)->states[st].accept & \
+    ((i) < (len) ? RX_ACCEPT : (len) ? RX_ACCEPT_EOL : RX_ACCEPT_EMPTY))
+
+/* Parse tree node types. */
+#define RN_EMPTY 0
+#define RN_SET 1
+#define RN_BOL 2
+#define RN_EOL 3
+#define RN_CAT 4
+#define RN_ALT 5
+#define RN_STAR 6
+#define RN_PLUS 7
+#define RN_QUEST 8
+
+struct rxInst {
+    unsigned char op;   /* RX_* */
+    short x, y;
+};
+
+struct rxNode {
+    unsigned char type; /* RN_* */
+    short set;          /* Set index of RN_SET. */
+    struct rxNode *l, *r;
+};
+
+struct rxState {
+    short *pcs;         /* Sorted NFA threads of the state. */
+    int npcs;
+    unsigned char accept;   /* RX_ACCEPT* */
+    short nostart;      /* Same threads without the entry, or RX_UNKNOWN. */
+};
+
+struct regex {
+    struct rxInst *prog;
+    int ninst;
+    unsigned char (*sets)[32];  /* Byte bitmaps used by RX_SET. */
+    int nsets;
+    int ustart;         /* Entry that first skips any number of bytes. */
+    int wstart;         /* Entry for RX_WORD, RX_WORD_SKIP is at wstart+1. */
+    unsigned char cls[256]; /* Byte to transition table column. */
+    int ncls;
+    struct rxState states[RX_DFA_STATES];
+    int nstates;
+    int flushes;        /* Number of times the cache was flushed. */
+    short *trans;       /* RX_DFA_STATES x ncls transitions. */
+    short start[4][2];  /* Start state by [RX_ANCHORED...][at row start]. */
+    int *mark, gen;     /* Visited marks for closures. */
+    short *stack, *buf, *tmp;  /* Closure scratch space. */
+    struct regex *rev;  /* Reversed program, NULL in the reversed one. */
+};
+
+/* Parser state. */
+struct rxParser {
+    const char *p, *end;
+    int nocase;
+    struct regex *rx;
+    struct rxNode *nodes;
+    int nnodes;
+    const char *err;
+};
+
+#define RX_SETBIT(s,c) ((s)[(unsigned char)(c)>>3] |= 1<<((c)&7))
+#define RX_INSET(s,c) ((s)[(unsigned char)(c)>>3] & (1<<((c)&7)))
+
+struct rxNode *rxNewNode(struct rxParser *ps, int type, struct rxNode *l,
+                         struct rxNode *r) {
+    struct rxNode *n = &ps->nodes[ps->nnodes++];
+    n->type = type;
+    n->l = l;
+    n->r = r;
+    n->set = -1;
+    return n;
+}
+
+/* Add an empty byte set to the program, returning its index. */
+int rxNewSet(struct regex *rx) {
+    rx->sets = realloc(rx->sets,sizeof(rx->sets[0])*(rx->nsets+1));
+    memset(rx->sets[rx->nsets],0,sizeof(rx->sets[0]));
+    return rx->nsets++;
+}
+
+/* Add the class escape 'c' (\d, \w or \s) to 'set', or return 0 if 'c' is
+ * not a class escape. */
+int rxEscapeClass(unsigned char *set, int c) {
+    int b;
+
+    if (c != 'd' && c != 'w' && c != 's') return 0;
+    for (b = 0; b < 256; b++) {
+        if ((c == 'd' && isdigit(b)) || (c == 'w' && isIdentChar(b)) ||
+            (c == 's' && isspace(b))) RX_SETBIT(set,b);
+    }
+    return 1;
+}
+
+/* Give 'set' both cases of every letter it holds. */
+void rxFoldSet(unsigned char *set) {
+    int b;
+    for (b = 0; b < 256; b++) {
+        if (RX_INSET(set,b)) {
+            RX_SETBIT(set,tolower(b));
+            RX_SETBIT(set,toupper(b));
+        }
+    }
+}
+
+/* Parse a bracket class, the opening '[' already consumed. */
+struct rxNode *rxParseClass(struct rxParser *ps) {
+    struct rxNode *n = rxNewNode(ps,RN_SET,NULL,NULL);
+    unsigned char *set;
+    int neg = 0, first = 1, b;
+
+    n->set = rxNewSet(ps->rx);
+    set = ps->rx->sets[n->set];
+    if (ps->p < ps->end && *ps->p == '^') {
+        neg = 1;
+        ps->p++;
+    }
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        int lo = (unsigned char)*ps->p++, hi;
+        first = 0;
+        if (lo == '\\' && ps->p < ps->end) {
+            lo = (unsigned char)*ps->p++;
+            if (rxEscapeClass(set,lo)) continue;
+        }
+        hi = lo;
+        if (ps->p+1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+        }
+        for (b = lo; b <= hi; b++) RX_SETBIT(set,b);
+    }
+    if (ps->p == ps->end) {
+        ps->err = "Missing ]";
+        return NULL;
+    }
+    ps->p++;
+    if (ps->nocase) rxFoldSet(set);
+    if (neg) for (b = 0; b < 32; b++) set[b] = ~set[b];
+    return n;
+}
+
+struct rxNode *rxParseAlt(struct rxParser *ps);
+
+struct rxNode *rxParseAtom(struct rxParser *ps) {
+    struct rxNode *n;
+    unsigned char *set;
+    int c = (unsigned char)*ps->p++;
+
+    switch(c) {
+    case '(':
+        if ((n = rxParseAlt(ps)) == NULL) return NULL;
+        if (ps->p == ps->end || *ps->p != ')') {
+            ps->err = "Missing )";
+            return NULL;
+        }
+        ps->p++;
+        return n;
+    case '[':
+        return rxParseClass(ps);
+    case '^':
+        return rxNewNode(ps,RN_BOL,NULL,NULL);
+    case '$':
+        return rxNewNode(ps,RN_EOL,NULL,NULL);
+    case '*': case '+': case '?':
+        ps->err = "Nothing to repeat";
+        return NULL;
+    }
+
+    n = rxNewNode(ps,RN_SET,NULL,NULL);
+    n->set = rxNewSet(ps->rx);
+    set = ps->rx->sets[n->set];
+    if (c == '.') {
+        memset(set,0xff,32);
+        return n;
+    }
+    if (c == '\\') {
+        if (ps->p == ps->end) {
+            ps->err = "Trailing \\";
+            return NULL;
+        }
+        c = (unsigned char)*ps->p++;
+        if (rxEscapeClass(set,c)) return n;
+    }
+    RX_SETBIT(set,c);
+    if (ps->nocase) rxFoldSet(set);
+    return n;
+}
+
+struct rxNode *rxParseRepeat(struct rxParser *ps) {
+    struct rxNode *n = rxParseAtom(ps);
+
+    while (n && ps->p < ps->end &&
+           (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+        int type = (*ps->p == '*') ? RN_STAR :
+                   (*ps->p == '+') ? RN_PLUS : RN_QUEST;
+        n = rxNewNode(ps,type,n,NULL);
+        ps->p++;
+    }
+    return n;
+}
+
+struct rxNode *rxParseCat(struct rxParser *ps) {
+    struct rxNode *n = NULL, *a;
+
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        if ((a = rxParseRepeat(ps)) == NULL) return NULL;
+        n = n ? rxNewNode(ps,RN_CAT,n,a) : a;
+    }
+    return n ? n : rxNewNode(ps,RN_EMPTY,NULL,NULL);
+}
+
+struct rxNode *rxParseAlt(struct rxParser *ps) {
+    struct rxNode *n = rxParseCat(ps), *r;
+
+    while (n && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        if ((r = rxParseCat(ps)) == NULL) return NULL;
+        n = rxNewNode(ps,RN_ALT,n,r);
+    }
+    return n;
+}
+
+/* Append an instruction to the program, returning its address. */
+int rxEmitInst(struct regex *rx, int op, int x, int y) {
+    rx->prog = realloc(rx->prog,sizeof(struct rxInst)*(rx->ninst+1));
+    rx->prog[rx->ninst].op = op;
+    rx->prog[rx->ninst].x = x;
+    rx->prog[rx->ninst].y = y;
+    return rx->ninst++;
+}
+
+/* Compile the tree 'n' into the program, Thompson style. If 'rev' is set
+ * the program matches the reversed strings. */
+void rxEmit(struct regex *rx, struct rxNode *n, int rev) {
+    int l1, l2;
+
+    switch(n->type) {
+    case RN_SET: rxEmitInst(rx,RX_SET,n->set,0); break;
+    case RN_BOL: rxEmitInst(rx,rev ? RX_EOL : RX_BOL,0,0); break;
+    case RN_EOL: rxEmitInst(rx,rev ? RX_BOL : RX_EOL,0,0); break;
+    case RN_CAT:
+        rxEmit(rx,rev ? n->r : n->l,rev);
+        rxEmit(rx,rev ? n->l : n->r,rev);
+        break;
+    case RN_ALT:
+        l1 = rxEmitInst(rx,RX_SPLIT,rx->ninst+1,0);
+        rxEmit(rx,n->l,rev);
+        l2 = rxEmitInst(rx,RX_JMP,0,0);
+        rx->prog[l1].y = rx->ninst;
+        rxEmit(rx,n->r,rev);
+        rx->prog[l2].x = rx->ninst;
+        break;
+    case RN_STAR:
+        l1 = rxEmitInst(rx,RX_SPLIT,rx->ninst+1,0);
+        rxEmit(rx,n->l,rev);
+        rxEmitInst(rx,RX_JMP,l1,0);
+        rx->prog[l1].y = rx->ninst;
+        break;
+    case RN_PLUS:
+        l1 = rx->ninst;
+        rxEmit(rx,n->l,rev);
+        rxEmitInst(rx,RX_SPLIT,l1,rx->ninst+1);
+        break;
+    case RN_QUEST:
+        l1 = rxEmitInst(rx,RX_SPLIT,rx->ninst+1,0);
+        rxEmit(rx,n->l,rev);
+        rx->prog[l1].y = rx->ninst;
+        break;
+    }
+}
+
+/* Split the bytes into classes that no set of the program tells apart. */
+void rxBuildClasses(struct regex *rx) {
+    short newcls[256][2];
+    int s, b, n;
+
+    memset(rx->cls,0,sizeof(rx->cls));
+    rx->ncls = 1;
+    for (s = 0; s < rx->nsets; s++) {
+        for (b = 0; b < rx->ncls; b++) newcls[b][0] = newcls[b][1] = -1;
+        n = 0;
+        for (b = 0; b < 256; b++) {
+            int in = RX_INSET(rx->sets[s],b) != 0;
+            short *nc = &newcls[rx->cls[b]][in];
+            if (*nc == -1) *nc = n++;
+            rx->cls[b] = *nc;
+        }
+        rx->ncls = n;
+    }
+}
+
+void rxFree(struct regex *rx) {
+    int j;
+
+    if (rx == NULL) return;
+    rxFree(rx->rev);
+    for (j = 0; j < rx->nstates; j++) free(rx->states[j].pcs);
+    free(rx->prog);
+    free(rx->sets);
+    free(rx->trans);
+    free(rx->mark);
+    free(rx->stack);
+    free(rx->buf);
+    free(rx->tmp);
+    free(rx);
+}
+
+/* Compile 'tree' into 'rx', reversed if 'rev' is set, followed by the
+ * entries of rxStart(), and allocate the DFA tables. */
+void rxBuild(struct regex *rx, struct rxNode *tree, int rev) {
+    int any, nonword, b;
+
+    rxEmit(rx,tree,rev);
+    rxEmitInst(rx,RX_MATCH,0,0);
+
+    any = rxNewSet(rx);
+    memset(rx->sets[any],0xff,32);
+    nonword = rxNewSet(rx);
+    for (b = 0; b < 256; b++)
+        if (!isIdentChar(b)) RX_SETBIT(rx->sets[nonword],b);
+
+    /* The unanchored entry loops over any byte before entering at 0. */
+    rx->ustart = rxEmitInst(rx,RX_SPLIT,0,rx->ninst+1);
+    rxEmitInst(rx,RX_SET,any,0);
+    rxEmitInst(rx,RX_JMP,rx->ustart,0);
+    /* The word entries only enter at 0 right after a non word byte. */
+    rx->wstart = rxEmitInst(rx,RX_SPLIT,0,rx->ninst+1);
+    rxEmitInst(rx,RX_SPLIT,rx->ninst+1,rx->ninst+3);
+    rxEmitInst(rx,RX_SET,any,0);
+    rxEmitInst(rx,RX_JMP,rx->wstart+1,0);
+    rxEmitInst(rx,RX_SET,nonword,0);
+    rxEmitInst(rx,RX_JMP,0,0);
+
+    rxBuildClasses(rx);
+    rx->trans = malloc(sizeof(short)*RX_DFA_STATES*rx->ncls);
+    rx->mark = calloc(rx->ninst,sizeof(int));
+    rx->stack = malloc(sizeof(short)*(rx->ninst*2+2));
+    rx->buf = malloc(sizeof(short)*rx->ninst);
+    rx->tmp = malloc(sizeof(short)*rx->ninst);
+    memset(rx->start,-1,sizeof(rx->start));
+}
+
+/* Compile the 'len' bytes at 'pat'. Return NULL and set '*err' if the
+ * pattern is not valid. */
+struct regex *rxCompile(const char *pat, int len, int nocase,
+                        const char **err) {
+    struct regex *rx = calloc(1,sizeof(*rx));
+    struct rxParser ps;
+    struct rxNode *tree;
+
+    ps.p = pat;
+    ps.end = pat+len;
+    ps.nocase = nocase;
+    ps.rx = rx;
+    ps.nodes = malloc(sizeof(struct rxNode)*(len*2+2));
+    ps.nnodes = 0;
+    ps.err = NULL;
+    tree = rxParseAlt(&ps);
+    if (tree && ps.p != ps.end) ps.err = "Unmatched )";
+    if (ps.err) {
+        *err = ps.err;
+        free(ps.nodes);
+        rxFree(rx);
+        return NULL;
+    }
+    /* The reversed program reads the same sets. */
+    rx->rev = calloc(1,sizeof(*rx));
+    rx->rev->sets = malloc(sizeof(rx->sets[0])*(rx->nsets ? rx->nsets : 1));
+    memcpy(rx->rev->sets,rx->sets,sizeof(rx->sets[0])*rx->nsets);
+    rx->rev->nsets = rx->nsets;
+    rxBuild(rx,tree,0);
+    rxBuild(rx->rev,tree,1);
+    free(ps.nodes);
+    return rx;
+}
+
+/* Add to 'out' the threads reachable from 'pc' without consuming a byte.
+ * RX_BOL is passed only if 'bol' is set, and RX_EOL only if 'eol' is,
+ * otherwise it is kept as a thread to resolve when the row ends. Threads
+ * already marked are skipped. */
+void rxAddThread(struct regex *rx, int pc, int bol, int eol, short *out,
+                 int *n) {
+    int sp = 0;
+
+    rx->stack[sp++] = pc;
+    while (sp) {
+        pc = rx->stack[--sp];
+        if (rx->mark[pc] == rx->gen) continue;
+        rx->mark[pc] = rx->gen;
+        switch(rx->prog[pc].op) {
+        case RX_JMP: rx->stack[sp++] = rx->prog[pc].x; break;
+        case RX_SPLIT:
+            rx->stack[sp++] = rx->prog[pc].y;
+            rx->stack[sp++] = rx->prog[pc].x;
+            break;
+        case RX_BOL: if (bol) rx->stack[sp++] = pc+1; break;
+        case RX_EOL:
+            if (eol) rx->stack[sp++] = pc+1;
+            else out[(*n)++] = pc;
+            break;
+        default: out[(*n)++] = pc; break;
+        }
+    }
+}
+
+/* Return the cached state for the 'n' threads in 'pcs', adding it if
+ * needed. A full cache is flushed first. */
+int rxGetState(struct regex *rx, short *pcs, int n) {
+    struct rxState *st;
+    int i, j;
+
+    /* Sort the threads so equal sets compare equal. */
+    for (i = 1; i < n; i++) {
+        short v = pcs[i];
+        for (j = i; j > 0 && pcs[j-1] > v; j--) pcs[j] = pcs[j-1];
+        pcs[j] = v;
+    }
+    for (i = 0; i < rx->nstates; i++) {
+        st = &rx->states[i];
+        if (st->npcs == n && !memcmp(st->pcs,pcs,sizeof(short)*n)) return i;
+    }
+    if (rx->nstates == RX_DFA_STATES) {
+        for (i = 0; i < rx->nstates; i++) free(rx->states[i].pcs);
+        rx->nstates = 0;
+        rx->flushes++;
+        memset(rx->start,-1,sizeof(rx->start));
+    }
+
+    st = &rx->states[rx->nstates];
+    st->pcs = malloc(sizeof(short)*(n ? n : 1));
+    memcpy(st->pcs,pcs,sizeof(short)*n);
+    st->npcs = n;
+    st->nostart = RX_UNKNOWN;
+    st->accept = 0;
+    for (i = 0; i < n; i++)
+        if (rx->prog[pcs[i]].op == RX_MATCH) st->accept |= RX_ACCEPT;
+    /* Threads left at the row end, then at the end of an empty row. */
+    for (j = 0; j < 2; j++) {
+        int m = 0, k;
+        rx->gen++;
+        for (i = 0; i < n; i++) rxAddThread(rx,pcs[i],j,1,rx->tmp,&m);
+        for (k = 0; k < m; k++)
+            if (rx->prog[rx->tmp[k]].op == RX_MATCH)
+                st->accept |= j ? RX_ACCEPT_EMPTY : RX_ACCEPT_EOL;
+    }
+    for (i = 0; i < rx->ncls; i++)
+        rx->trans[rx->nstates*rx->ncls+i] = RX_UNKNOWN;
+    return rx->nstates++;
+}
+
+/* Return the start state for matches beginning as 'entry' (RX_ANCHORED...)
+ * tells, 'bol' set when the search starts at the beginning of the row. */
+int rxStart(struct regex *rx, int entry, int bol) {
+    int n = 0, pc;
+
+    if (rx->start[entry][bol] != -1) return rx->start[entry][bol];
+    switch(entry) {
+    case RX_ANCHORED: pc = 0; break;
+    case RX_UNANCHORED: pc = rx->ustart; break;
+    case RX_WORD: pc = rx->wstart; break;
+    default: pc = rx->wstart+1; break;
+    }
+    rx->gen++;
+    rxAddThread(rx,pc,bol,0,rx->buf,&n);
+    n = rxGetState(rx,rx->buf,n);
+    rx->start[entry][bol] = n;
+    return n;
+}
+
+/* Return the state reached from 'st' by consuming 'c', or RX_DEAD. */
+int rxStep(struct regex *rx, int st, int c) {
+    short *t = &rx->trans[st*rx->ncls+rx->cls[c]];
+    struct rxState *s;
+    int i, n = 0, flushes, next;
+
+    if (*t != RX_UNKNOWN) return *t;
+    s = &rx->states[st];
+    rx->gen++;
+    for (i = 0; i < s->npcs; i++) {
+        struct rxInst *in = &rx->prog[s->pcs[i]];
+        if (in->op == RX_SET && RX_INSET(rx->sets[in->x],c))
+            rxAddThread(rx,s->pcs[i]+1,0,0,rx->buf,&n);
+    }
+    if (n == 0) return (*t = RX_DEAD);
+    flushes = rx->flushes;
+    next = rxGetState(rx,rx->buf,n);
+    /* After a flush 'st' is gone, and so is the slot of 't'. */
+    if (flushes == rx->flushes) *t = next;
+    return next;
+}
+
+/* Return the state holding the threads of 'st' that are past the entry,
+ * so that no further match starts, or RX_DEAD if there are none. */
+int rxDropStarts(struct regex *rx, int st) {
+    struct rxState *s = &rx->states[st];
+    int i, n = 0, flushes, next;
+
+    if (s->nostart != RX_UNKNOWN) return s->nostart;
+    for (i = 0; i < s->npcs; i++)
+        if (s->pcs[i] < rx->ustart) rx->buf[n++] = s->pcs[i];
+    if (n == 0) return (s->nostart = RX_DEAD);
+    flushes = rx->flushes;
+    next = rxGetState(rx,rx->buf,n);
+    if (flushes == rx->flushes) s->nostart = next;
+    return next;
+}
+
+/* The state reached from 'st' by consuming 'c', from the table if known. */
+#define RX_NEXT(rx,st,c) ((rx)->trans[(st)*(rx)->ncls+(rx)->cls[c]] >= 0 ? \
+    (rx)->trans[(st)*(rx)->ncls+(rx)->cls[c]] : rxStep(rx,st,c))
+
+/* Can a whole word match end at offset 'i' of the 'len' bytes at 's'? */
+#define RX_WORD_END(s,i,len) ((i) == (len) || !isIdentChar((s)[i]))
+
+/* Search 's' of length 'slen' for the leftmost longest match starting at
+ * or after 'from'. Return its offset and set '*mlen', or return -1. Unless
+ * 'word' is zero, only matches that are a whole word count.
+ *
+ * Each pass is linear. The unanchored DFA finds where the first match
+ * ends; the leftmost match has started by then, so from there no new
+ * match is started, and the run goes on to 'last', the last offset where
+ * one of the started matches ends. The reversed DFA, run back from 'last'
+ * to 'from', accepts at every offset where a match ending by 'last'
+ * starts: the leftmost is the match start. Finally the anchored DFA finds
+ * the longest match from there. */
+int rxSearch(struct regex *rx, const char *s, int slen, int from, int word,
+             int *mlen) {
+    const unsigned char *u = (const unsigned char*)s;
+    struct regex *rv = rx->rev;
+    int st, i, start = -1, end = -1, last;
+
+    if (from > slen) return -1;
+    if (!word)
+        st = rxStart(rx,RX_UNANCHORED,from == 0);
+    else
+        st = rxStart(rx,from == 0 || !isIdentChar(s[from-1]) ?
+                        RX_WORD : RX_WORD_SKIP,from == 0);
+    for (i = from; ; i++) {
+        if (RX_ACCEPTS(rx,st,i,slen) && (!word || RX_WORD_END(s,i,slen)))
+            break;
+        if (i == slen) return -1;
+        st = RX_NEXT(rx,st,u[i]);
+    }
+
+    last = i;
+    for (st = rxDropStarts(rx,st); st != RX_DEAD; i++) {
+        if (RX_ACCEPTS(rx,st,i,slen) && (!word || RX_WORD_END(s,i,slen)))
+            last = i;
+        if (i == slen) break;
+        st = RX_NEXT(rx,st,u[i]);
+    }
+
+    /* The reversed program sees offset 'i' as 'slen-i'. */
+    st = rxStart(rv,word ? RX_WORD : RX_UNANCHORED,last == slen);
+    for (i = last; ; i--) {
+        if (RX_ACCEPTS(rv,st,slen-i,slen) &&
+            (!word || i == 0 || !isIdentChar(s[i-1]))) start = i;
+        if (i == from) break;
+        st = RX_NEXT(rv,st,u[i-1]);
+    }
+    if (start == -1) return -1;
+
+    st = rxStart(rx,RX_ANCHORED,start == 0);
+    for (i = start; st != RX_DEAD; i++) {
+        if (RX_ACCEPTS(rx,st,i,slen) && (!word || RX_WORD_END(s,i,slen)))
+            end = i;
+        if (i == last) break;
+        st = RX_NEXT(rx,st,u[i]);
+    }
+    if (end == -1) return -1;
+    *mlen = end-start;
+    return start;
+}
+
+/* ============================== Trigram index =============================
+ *
+ * Files of at least TRI_MIN_ROWS rows get an index that lets a search skip
+ * most rows. Rows are grouped in blocks of E.tri_rows rows, and every
+ * trigram (three consecutive bytes of a row, lower cased) is hashed to one
+ * of TRI_BUCKETS buckets. A bucket holds a bitmap with a bit set for every
+ * block containing one of its trigrams. A literal query of three or more
+ * bytes can only match in a block whose bit is set in the bucket of each of
+ * its trigrams, so ANDing those bitmaps leaves the blocks worth scanning.
+ * Hash collisions only add blocks, never lose one.
+ *
+ * A bit can't be cleared for a single row, so an edited block is flagged
+ * stale, always searched, and rebuilt from its rows while the editor waits
+ * for keys. Inserting or deleting a row shifts every block below, which are
+ * all flagged. Blocks grow so the bitmaps stay under TRI_MAX_BYTES, and the
+ * index is dropped for good if less than TRI_HEADROOM bytes of heap are
+ * left. */
+
+#define TRI_MIN_ROWS 2000   /* Smaller files are scanned quickly enough. */
+#define TRI_BUCKETS 4096    /* Power of two. */
+#define TRI_MAX_BYTES 65536 /* Bound for the bucket bitmaps. */
+#define TRI_MIN_BLOCK 64    /* Fewest rows per block. */
+#define TRI_HEADROOM 32768  /* Heap the index must leave free. */
+
+/* Shifts and xors only, multiplying is slow on the 68000. */
+#define TRI_HASH(a,b,c) \
+    ((((a)<<7)^((b)<<3)^((b)>>5)^(c)) & (TRI_BUCKETS-1))
+
+static unsigned char triFold[256];
+
+void triFree(void) {
+    free(E.tri_bits);
+    free(E.tri_stale);
+    E.tri_bits = NULL;
+    E.tri_stale = NULL;
+}
+
+/* Lay the index out for the current number of rows, every block stale.
+ * Return 0 if the memory isn't there. */
+int triAlloc(void) {
+    int nblocks, j;
+
+    if (triFold['A'] != 'a') for (j = 0; j < 256; j++) triFold[j] = tolower(j);
+    E.tri_rows = TRI_MIN_BLOCK;
+    /* Room for a quarter more rows before the layout must change. */
+    while (1) {
+        nblocks = (E.numrows+E.numrows/4)/E.tri_rows+1;
+        E.tri_cap = (nblocks+7) & ~7;
+        if ((long)TRI_BUCKETS*(E.tri_cap/8) <= TRI_MAX_BYTES) break;
+        E.tri_rows *= 2;
+    }
+    E.tri_bits = malloc(TRI_BUCKETS*(E.tri_cap/8));
+    E.tri_stale = malloc(E.tri_cap);
+    if (E.tri_bits == NULL || E.tri_stale == NULL) {
+        triFree();
+        return 0;
+    }
+    memset(E.tri_bits,0,TRI_BUCKETS*(E.tri_cap/8));
+    memset(E.tri_stale,1,E.tri_cap);
+    E.tri_nstale = E.tri_cap;
+    E.tri_report = 1;
+    return 1;
+}
+
+/* Flag stale the block holding row 'at'. */
+void triMarkRow(int at) {
+    int b;
+
+    if (E.tri_bits == NULL) return;
+    b = at/E.tri_rows;
+    if (b >= E.tri_cap) {
+        triFree();  /* Outgrew the layout, start over. */
+        return;
+    }
+    if (!E.tri_stale[b]) {
+        E.tri_stale[b] = 1;
+        E.tri_nstale++;
+    }
+}
+
+/* A row was inserted or deleted at 'at': every block from there on now
+ * holds different rows. */
+void triShift(int at) {
+    int b;
+
+    if (E.tri_bits == NULL) return;
+    if (E.numrows > E.tri_cap*E.tri_rows) {
+        triFree();
+        return;
+    }
+    for (b = at/E.tri_rows; b < E.tri_cap; b++) {
+        if (!E.tri_stale[b]) {
+            E.tri_stale[b] = 1;
+            E.tri_nstale++;
+        }
+    }
+}
+
+/* Rebuild the bits of block 'b' from its rows. */
+void triBuildBlock(int b) {
+    unsigned char *bits = E.tri_bits+b/8, bit = 1<<(b&7);
+    int stride = E.tri_cap/8, j, i;
+
+    for (j = 0; j < TRI_BUCKETS; j++) bits[j*stride] &= ~bit;
+    for (j = b*E.tri_rows; j < (b+1)*E.tri_rows && j < E.numrows; j++) {
+        const unsigned char *s = (const unsigned char*)E.row[j].chars;
+        for (i = 0; i+2 < E.row[j].size; i++)
+            bits[TRI_HASH(triFold[s[i]],triFold[s[i+1]],triFold[s[i+2]])*
+                 stride] |= bit;
+    }
+    E.tri_stale[b] = 0;
+    E.tri_nstale--;
+}
+
+/* Do a slice of the index upkeep: lay it out or rebuild one stale block.
+ * Meant to be called while no key is pending. Return 0 once there is
+ * nothing left to do. */
+int triIdleStep(void) {
+    void *probe;
+    int b;
+
+    if (E.tri_off || E.numrows < TRI_MIN_ROWS) return 0;
+    if (E.tri_bits && E.tri_nstale == 0) {
+        if (E.tri_report) {
+            editorSetStatusMessage("Search index: %d rows per block, %d bytes",
+                E.tri_rows, TRI_BUCKETS*(E.tri_cap/8)+E.tri_cap);
+            E.tri_report = 0;
+        }
+        return 0;
+    }
+    /* Give the memory back rather than let the editor run short. */
+    probe = malloc(TRI_HEADROOM);
+    if (probe == NULL || (E.tri_bits == NULL && !triAlloc())) {
+        free(probe);
+        triFree();
+        E.tri_off = 1;
+        editorSetStatusMessage("Search index dropped: low memory");
+        return 0;
+    }
+    free(probe);
+    for (b = 0; !E.tri_stale[b]; b++);
+    triBuildBlock(b);
+    return 1;
+}
+
+/* Return a bitmap of the blocks that may hold the 'len' bytes at 'pat', or
+ * NULL if the index can't tell. The bitmap is valid until the next call. */
+unsigned char *triCandidates(const char *pat, int len) {
+    static unsigned char *mask = NULL;
+    static int maskcap = 0;
+    const unsigned char *p = (const unsigned char*)pat;
+    int stride = E.tri_cap/8, i, j;
+
+    if (E.tri_bits == NULL || len < 3) return NULL;
+    if (maskcap < stride) {
+        maskcap = stride;
+        mask = realloc(mask,maskcap);
+    }
+    memset(mask,0xff,stride);
+    for (i = 0; i+2 < len; i++) {
+        unsigned char *bits = E.tri_bits+
+            TRI_HASH(triFold[p[i]],triFold[p[i+1]],triFold[p[i+2]])*stride;
+        for (j = 0; j < stride; j++) mask[j] &= bits[j];
+    }
+    for (j = 0; j < E.tri_cap; j++)
+        if (E.tri_stale[j]) mask[j/8] |= 1<<(j&7);
+    return mask;
+}
+
+/* ============================== Search engine =============================
+ *
+ * Queries are compiled once per change into a Boyer-Moore-Horspool skip
+ * table: after a mismatch the window slides by the distance from the last
+ * occurrence of its final byte in the query to the query end, so most bytes
+ * of a row are never looked at.
+ *
+ * Bytes are compared through a fold table, the identity for a case
+ * sensitive search or a lower casing one otherwise, so both modes share
+ * the same scanning loop. In SEARCH_REGEX mode the query is compiled into a
+ * regular expression instead, see above. */
+
+#define KILO_QUERY_LEN 256
+
+#define SEARCH_NOCASE (1<<0)    /* Ignore case. */
+#define SEARCH_WORD (1<<1)      /* Only match whole words. */
+#define SEARCH_REGEX (1<<2)     /* Query is a regular expression. */
+
+struct searchQuery {
+    char pat[KILO_QUERY_LEN+1]; /* Query, folded. */
+    int len;
+    int flags;                  /* SEARCH_* */
+    const unsigned char *fold;  /* Fold table of the query mode. */
+    unsigned short skip[256];   /* Slide for each final window byte. */
+    struct regex *rx;           /* SEARCH_REGEX program, NULL if invalid. */
+    const char *err;            /* Why the regex is invalid. */
+};
+
+static unsigned char foldNone[256], foldCase[256];
+
+/* Compile the 'len' bytes at 'pat' into 'q' for a search in mode 'flags'.
+ * Any program 'q' held is freed, so 'q->rx' must be NULL the first time. */
+void searchCompile(struct searchQuery *q, const char *pat, int len,
+                   int flags) {
+    unsigned short skip[256];
+    int j;
+
+    rxFree(q->rx);
+    q->rx = NULL;
+    q->err = NULL;
+    if (flags & SEARCH_REGEX)
+        q->rx = rxCompile(pat,len,flags & SEARCH_NOCASE,&q->err);
+
+    if (foldCase['A'] != 'a') {
+        for (j = 0; j < 256; j++) {
+            foldNone[j] = j;
+            foldCase[j] = tolower(j);
+        }
+    }
+    q->fold = (flags & SEARCH_NOCASE) ? foldCase : foldNone;
+    q->flags = flags;
+    q->len = len;
+    for (j = 0; j < len; j++) q->pat[j] = q->fold[(unsigned char)pat[j]];
+    q->pat[len] = '\0';
+
+    /* Slides are computed on folded bytes, then spread to every byte that
+     * folds to them so the scan indexes the table with raw bytes. */
+    for (j = 0; j < 256; j++) skip[j] = len ? len : 1;
+    for (j = 0; j < len-1; j++) skip[(unsigned char)q->pat[j]] = len-1-j;
+    for (j = 0; j < 256; j++) q->skip[j] = skip[q->fold[j]];
+}
+
+/* Return the offset of the first match of 'q' in the 'slen' bytes at 's'
+ * starting at or after 'from', or -1 if there is none. Unless 'word' is
+ * zero, matches that aren't a whole word are skipped. The match length is
+ * stored in '*mlen' unless it is NULL. */
+int searchBuffer(struct searchQuery *q, const char *s, int slen, int from,
+                 int word, int *mlen) {
+    const unsigned char *f = q->fold;
+    const char *p = q->pat;
+    int last = q->len-1, i, j, len;
+
+    if (q->flags & SEARCH_REGEX) {
+        if (q->rx == NULL) return -1;
+        i = rxSearch(q->rx,s,slen,from,word,&len);
+        if (i != -1 && mlen) *mlen = len;
+        return i;
+    }
+    if (mlen) *mlen = q->len;
+    if (q->len == 0) return (from <= slen) ? from : -1;
+    for (i = from; i+last < slen; i += q->skip[(unsigned char)s[i+last]]) {
+        if (f[(unsigned char)s[i+last]] != (unsigned char)p[last]) continue;
+        for (j = last-1; j >= 0 &&
+             f[(unsigned char)s[i+j]] == (unsigned char)p[j]; j--);
+        if (j >= 0) continue;
+        if (word && ((i > 0 && isIdentChar(s[i-1])) ||
+                     (i+q->len < slen && isIdentChar(s[i+q->len])))) continue;
+        return i;
+    }
+    return -1;
+}
+
+/* Store in '*out' a new array with the rows among the 'nrows' of 'rows'
+ * holding a match of 'q', in the same order, and return their count. A NULL
+ * 'rows' stands for all the rows of the file. SEARCH_WORD is only honoured
+ * if 'word' is set. Rows the trigram index rules out aren't looked at. */
+int searchRows(struct searchQuery *q, int *rows, int nrows, int **out,
+               int word) {
+    unsigned char *blocks = NULL;
+    int k, n = 0;
+
+    *out = malloc(sizeof(int)*(nrows ? nrows : 1));
+    if (q->flags & SEARCH_REGEX) {
+        if (q->rx == NULL) return 0;
+    } else {
+        blocks = triCandidates(q->pat,q->len);
+    }
+    for (k = 0; k < nrows; k++) {
+        erow *row = &E.row[rows ? rows[k] : k];
+        if (blocks) {
+            int b = row->idx/E.tri_rows;
+            if (b < E.tri_cap && !(blocks[b/8] & (1<<(b&7)))) {
+                /* All the rows skip the rest of the block at once. */
+                if (!rows) k = (b+1)*E.tri_rows-1;
+                continue;
+            }
+        }
+        if (searchBuffer(q,row->chars,row->size,0,word,NULL) != -1)
+            (*out)[n++] = row->idx;
+    }
+    return n;
+}
+
+/* Return the position in the sorted 'rows' (all rows if NULL) of the first
+ * row after 'row' in direction 'dir', wrapping around the file ends. */
+int searchStep(int *rows, int nrows, int row, int dir) {
+    int lo = 0, hi = nrows;
+
+    /* First position holding a row >= row+1 (forward) or >= row (back). */
+    if (dir == 1) row++;
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+        if ((rows ? rows[mid] : mid) < row) lo = mid+1;
+        else hi = mid;
+    }
+    if (dir == 1) return (lo == nrows) ? 0 : lo;
+    return (lo == 0) ? nrows-1 : lo-1;
+}
+
+/* While searching, every match in the rows on screen is shown. The matches
+ * of a row are found once per query and kept as overlay spans, drawn over
+ * the syntax highlight without touching it. Only the rows on screen are
+ * cached: when the view scrolls, rows still visible keep their spans and
+ * only the newly exposed ones are searched. */
+struct matchCache {
+    struct searchQuery *q;  /* Query shown, NULL when not searching. */
+    int word;               /* Only show whole words. */
+    char pat[KILO_QUERY_LEN+1]; /* Query the spans were found for. */
+    int len, flags;
+    int lo, n;              /* Rows lo .. lo+n-1 are cached. */
+    struct hlSpan **sp;     /* Spans of each row, NULL if none. */
+    int *nsp;               /* Span count of each row, -1 until searched. */
+};
+
+static struct matchCache mcache;
+
+/* Drop every cached row. */
+void matchCacheFlush(void) {
+    int j;
+
+    for (j = 0; j < mcache.n; j++) free(mcache.sp[j]);
+    free(mcache.sp);
+    free(mcache.nsp);
+    mcache.sp = NULL;
+    mcache.nsp = NULL;
+    mcache.n = 0;
+}
+
+/* Show the matches of 'q', or stop showing matches if it is NULL. The
+ * cache survives as long as the query and its mode are the same. */
+void matchCacheUse(struct searchQuery *q, int word) {
+    if (q == NULL || q != mcache.q || word != mcache.word ||
+        q->len != mcache.len || q->flags != mcache.flags ||
+        memcmp(q->pat,mcache.pat,q->len)) {
+        matchCacheFlush();
+    }
+    mcache.q = q;
+    if (q == NULL) return;
+    mcache.word = word;
+    mcache.len = q->len;
+    mcache.flags = q->flags;
+    memcpy(mcache.pat,q->pat,q->len);
+}
+
+/* Make rows 'lo' to 'hi' the ones cached, keeping those already there. */
+void matchCacheView(int lo, int hi) {
+    int n = (hi >= lo) ? hi-lo+1 : 0, j;
+    struct hlSpan **sp;
+    int *nsp;
+
+    if (mcache.q == NULL || (lo == mcache.lo && n == mcache.n)) return;
+    sp = malloc(sizeof(struct hlSpan*)*(n ? n : 1));
+    nsp = malloc(sizeof(int)*(n ? n : 1));
+    for (j = 0; j < n; j++) {
+        sp[j] = NULL;
+        nsp[j] = -1;
+    }
+    for (j = 0; j < mcache.n; j++) {
+        int row = mcache.lo+j;
+        if (row >= lo && row < lo+n) {
+            sp[row-lo] = mcache.sp[j];
+            nsp[row-lo] = mcache.nsp[j];
+        } else {
+            free(mcache.sp[j]);
+        }
+    }
+    free(mcache.sp);
+    free(mcache.nsp);
+    mcache.sp = sp;
+    mcache.nsp = nsp;
+    mcache.lo = lo;
+    mcache.n = n;
+}
+
+/* Return the overlay spans of file row 'filerow' and set '*n' to their
+ * count, searching the row if it wasn't yet. NULL if nothing is shown. */
+struct hlSpan *matchCacheRow(int filerow, int *n) {
+    int j = filerow-mcache.lo, from = 0, off, len, cap = 0;
+    erow *row = &E.row[filerow];
+
+    *n = 0;
+    if (mcache.q == NULL || j < 0 || j >= mcache.n) return NULL;
+    if (mcache.nsp[j] == -1) {
+        mcache.nsp[j] = 0;
+        if (mcache.q->len || mcache.q->flags & SEARCH_REGEX) {
+            while ((off = searchBuffer(mcache.q,row->chars,row->size,from,
+                                       mcache.word,&len)) != -1) {
+                from = off+(len ? len : 1);
+                if (len == 0) continue; /* Nothing to show. */
+                if (mcache.nsp[j] == cap) {
+                    cap = cap ? cap*2 : 4;
+                    mcache.sp[j] = realloc(mcache.sp[j],
+                                           sizeof(struct hlSpan)*cap);
+                }
+                mcache.sp[j][mcache.nsp[j]].start = editorRowCxToRx(row,off);
+                mcache.sp[j][mcache.nsp[j]].len =
+                    editorRowCxToRx(row,off+len)-editorRowCxToRx(row,off);
+                mcache.sp[j][mcache.nsp[j]].hl = HL_MATCH;
+                mcache.nsp[j]++;
+            }
+        }
+    }
+    *n = mcache.nsp[j];
+    return mcache.sp[j];
+}
+
+/* The search prompt shows which match the cursor is on and how many there
+ * are. Counting every row of a long file would stall typing, so rows are
+ * counted a few at a time while the editor waits for keys, and the count
+ * stays valid as long as the query does: an edit only makes the count of
+ * the rows it touches stale. Rows 0 .. next-1 are counted into 'total',
+ * except the stale ones, whose 'nmatch' is -1. The counted matches before
+ * row 'pos' are kept in 'before' the same way, so the position of the
+ * cursor only costs the rows it moved over. */
+#define COUNT_STEP_ROWS 32  /* Rows searched between two key checks. */
+
+struct matchCount {
+    struct searchQuery q;   /* Query counted, compiled on its own. */
+    char query[KILO_QUERY_LEN+1];   /* The query as typed. */
+    int len, flags;         /* Its length and SEARCH_* flags. */
+    int active;             /* Is there a query to count? */
+    int next;               /* First row not counted yet. */
+    int stale;              /* No row before this one is stale. */
+    long total;             /* Matches in the counted rows. */
+    int pos;                /* Row last shown, never past 'next'. */
+    long before;            /* Matches in the counted rows before 'pos'. */
+};
+
+static struct matchCount mcount;
+
+/* Count the 'len' bytes at 'query' in mode 'flags' from now on, keeping
+ * the count if it is the query already counted. A zero 'len' stops. */
+void matchCountUse(const char *query, int len, int flags) {
+    if (len && mcount.active && len == mcount.len && flags == mcount.flags &&
+        !memcmp(query,mcount.query,len)) return;
+    mcount.active = 0;
+    if (len == 0) return;
+    searchCompile(&mcount.q,query,len,flags);
+    if (mcount.q.err) return;
+    memcpy(mcount.query,query,len);
+    mcount.len = len;
+    mcount.flags = flags;
+    mcount.active = 1;
+    mcount.next = mcount.stale = mcount.pos = 0;
+    mcount.total = mcount.before = 0;
+}
+
+/* Return the number of matches in 'row'. */
+int matchCountRow(erow *row) {
+    int from = 0, n = 0, off, len;
+
+    while (from <= row->size &&
+           (off = searchBuffer(&mcount.q,row->chars,row->size,from,
+                               mcount.flags & SEARCH_WORD,&len)) != -1) {
+        from = off+(len ? len : 1);
+        n++;
+    }
+    return n;
+}
+
+/* Count up to COUNT_STEP_ROWS rows, the stale ones first. Return 0 if
+ * there was nothing left to count. */
+int matchCountStep(void) {
+    int n = 0, at;
+    erow *row;
+
+    if (!mcount.active) return 0;
+    while (n < COUNT_STEP_ROWS) {
+        if (mcount.stale < mcount.next) {
+            at = mcount.stale++;
+            if (E.row[at].nmatch != -1) continue;
+        } else if (mcount.next < E.numrows) {
+            at = mcount.next++;
+            mcount.stale = mcount.next;
+        } else {
+            break;
+        }
+        row = &E.row[at];
+        row->nmatch = matchCountRow(row);
+        mcount.total += row->nmatch;
+        if (at < mcount.pos) mcount.before += row->nmatch;
+        n++;
+    }
+    return n != 0;
+}
+
+/* Count while no key is waiting. Return 1 if the count moved on and is
+ * worth showing, 0 if a key is waiting or there was nothing to count. */
+int matchCountIdle(void) {
+    if (!matchCountStep()) return 0;
+    while (!cli_key_pending(0) && matchCountStep());
+    return !cli_key_pending(0);
+}
+
+/* Row 'at' was edited: its count is stale. */
+void matchCountMarkRow(int at) {
+    erow *row = &E.row[at];
+
+    if (!mcount.active || at >= mcount.next || row->nmatch == -1) return;
+    mcount.total -= row->nmatch;
+    if (at < mcount.pos) mcount.before -= row->nmatch;
+    row->nmatch = -1;
+    if (at < mcount.stale) mcount.stale = at;
+}
+
+/* A row is inserted ('delta' 1) or about to be deleted ('delta' -1) at
+ * 'at'. The counts move with the rows, an inserted row is stale. */
+void matchCountShift(int at, int delta) {
+    if (!mcount.active || at >= mcount.next) return;
+    if (delta < 0 && E.row[at].nmatch != -1) {
+        mcount.total -= E.row[at].nmatch;
+        if (at < mcount.pos) mcount.before -= E.row[at].nmatch;
+    }
+    if (at < mcount.pos) mcount.pos += delta;
+    mcount.next += delta;
+    if (mcount.stale > at) mcount.stale = (delta > 0) ? at : mcount.stale-1;
+}
+
+/* Describe in 'buf' where the first match of row 'at' (-1 for none) stands
+ * among all of them, with '?' for what isn't counted yet. */
+void matchCountFormat(char *buf, int size, int at) {
+    char n[16] = "?", m[16] = "?";
+    int j;
+
+    buf[0] = '\0';
+    if (!mcount.active) return;
+    if (mcount.stale == E.numrows) {
+        if (mcount.total == 0) {
+            snprintf(buf,size," [no match]");
+            return;
+        }
+        snprintf(m,sizeof(m),"%ld",mcount.total);
+    }
+    /* Every row before 'at' must be counted. Walk 'pos' there from the
+     * row shown last; the rows it leaves behind may be stale. */
+    if (at >= 0 && at <= mcount.stale) {
+        for (j = mcount.pos; j < at; j++) mcount.before += E.row[j].nmatch;
+        for (j = mcount.pos-1; j >= at; j--)
+            if (E.row[j].nmatch != -1) mcount.before -= E.row[j].nmatch;
+        mcount.pos = at;
+        snprintf(n,sizeof(n),"%ld",mcount.before+1);
+    }
+    snprintf(buf,size," [%s of %s]",n,m);
+}
+
+/* =============================== Find mode ================================ */
+
+static int searchMode = 0; /* SEARCH_* flags, kept for the next search. */
+
+void editorFind() {
+    char query[KILO_QUERY_LEN+1] = {0};
+    int qlen = 0;
+    int last_match = -1; /* Last line where a match was found. -1 for none. */
+    int find_next = 0; /* if 1 search next, if -1 search prev. */
+    struct searchQuery q;
+    /* Extending the query can only drop matches, so each keystroke filters
+     * the rows that matched the shorter query: cand[n] are the rows holding
+     * a match of the first n query bytes. NULL stands for all the rows.
+     * A whole word match of the query needn't be one of its prefix, so the
+     * levels ignore SEARCH_WORD, and 'hits' filters the last one by it.
+     * Nor does a regex match of the query imply one of its prefix ("a|b"
+     * matches more than "a"), so in SEARCH_REGEX mode every level is
+     * searched over all the rows, and only BACKSPACE benefits. */
+    int *cand[KILO_QUERY_LEN+1];
+    int ncand[KILO_QUERY_LEN+1];
+    int *hits = NULL, nhits = 0;
+    char count[48]; /* Where the match stands, like " [3 of 17]". */
+    int j;
+
+    /* Save the cursor position in order to restore it later. */
+    int saved_cx = E.cx, saved_cy = E.cy;
+    int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
+
+    cand[0] = NULL;
+    ncand[0] = E.numrows;
+    q.rx = NULL;
+    searchCompile(&q,query,0,searchMode);
+
+    while(1) {
+        /* Count the matches until a key comes, showing how far it got. */
+        matchCountUse(query,qlen,searchMode);
+        do {
+            matchCountFormat(count,sizeof(count),last_match);
+            editorSetStatusMessage(
+              "Search%s%s%s: %s%s%s%s%s (ESC/Arrows/Enter, ^A case, ^W word, "
+              "^R re)",
+              (searchMode & SEARCH_NOCASE) ? " [Aa]" : "",
+              (searchMode & SEARCH_WORD) ? " [word]" : "",
+              (searchMode & SEARCH_REGEX) ? " [re]" : "", query,
+              q.err ? " (" : "", q.err ? q.err : "", q.err ? ")" : "", count);
+            matchCacheUse(&q,searchMode & SEARCH_WORD);
+            editorRefreshScreen();
+        } while (matchCountIdle());
+
+        int c = cli_getchar(0);
+        c = c & 0xFFFF;
+        if (c == BACKSPACE) {
+            /* Back to the rows cached for the shorter query. */
+            if (qlen != 0) {
+                free(cand[qlen]);
+                query[--qlen] = '\0';
+                searchCompile(&q,query,qlen,searchMode);
+            }
+            last_match = -1;
+        } else if (c == ESC || c == ENTER) {
+            if (c == ESC) {
                 E.cx = saved_cx; E.cy = saved_cy;
                 E.coloff = saved_coloff; E.rowoff = saved_rowoff;
             }
-            FIND_RESTORE_HL;
+            while (qlen) free(cand[qlen--]);
+            free(hits);
+            rxFree(q.rx);
+            matchCacheUse(NULL,0);
             editorSetStatusMessage("");
             return;
         } else if (c == CLI_KEY_RIGHT || c == CLI_KEY_DOWN) {
             find_next = 1;
         } else if (c == CLI_KEY_LEFT || c == CLI_KEY_UP) {
             find_next = -1;
+        } else if (c == CTRL_A || c == CTRL_W || c == CTRL_R) {
+            /* A new mode invalidates every cached level. */
+            searchMode ^= (c == CTRL_A) ? SEARCH_NOCASE :
+                          (c == CTRL_W) ? SEARCH_WORD : SEARCH_REGEX;
+            for (j = 1; j <= qlen; j++) {
+                free(cand[j]);
+                searchCompile(&q,query,j,searchMode);
+                ncand[j] = (searchMode & SEARCH_REGEX) ?
+                    searchRows(&q,NULL,E.numrows,&cand[j],0) :
+                    searchRows(&q,cand[j-1],ncand[j-1],&cand[j],0);
+            }
+            searchCompile(&q,query,qlen,searchMode);
+            last_match = -1;
         } else if (isprint(c)) {
             if (qlen < KILO_QUERY_LEN) {
                 query[qlen++] = c;
                 query[qlen] = '\0';
+                searchCompile(&q,query,qlen,searchMode);
+                ncand[qlen] = (searchMode & SEARCH_REGEX) ?
+                    searchRows(&q,NULL,E.numrows,&cand[qlen],0) :
+                    searchRows(&q,cand[qlen-1],ncand[qlen-1],&cand[qlen],0);
                 last_match = -1;
             }
         }
 
         /* Search occurrence. */
-        if (last_match == -1) find_next = 1;
+        if (last_match == -1) {
+            find_next = 1;
+            free(hits);
+            hits = NULL;
+            if (searchMode & SEARCH_WORD)
+                nhits = searchRows(&q,cand[qlen],ncand[qlen],&hits,1);
+        }
         if (find_next) {
-            char *match = NULL;
+            int *rows = (searchMode & SEARCH_WORD) ? hits : cand[qlen];
+            int nrows = (searchMode & SEARCH_WORD) ? nhits : ncand[qlen];
+            int match = 0;
             int match_offset = 0;
-            int i, current = last_match;
-
-            for (i = 0; i < E.numrows; i++) {
-                current += find_next;
-                if (current == -1) current = E.numrows-1;
-                else if (current == E.numrows) current = 0;
-                match = strstr(E.row[current].render,query);
-                if (match) {
-                    match_offset = match-E.row[current].render;
-                    break;
-                }
+            int current = 0;
+
+            if (nrows) {
+                int k = (last_match == -1) ? 0 :
+                    searchStep(rows,nrows,last_match,find_next);
+                erow *row;
+                current = rows ? rows[k] : k;
+                row = &E.row[current];
+                match_offset = searchBuffer(&q,row->chars,row->size,0,
+                                            searchMode & SEARCH_WORD,NULL);
+                match = 1;
             }
             find_next = 0;
 
-            /* Highlight */
-            FIND_RESTORE_HL;
-
+            /* The match cache highlights it, along with the others. */
             if (match) {
-                erow *row = &E.row[current];
                 last_match = current;
-                if (row->hl) {
-                    saved_hl_line = current;
-                    saved_hl = malloc(row->rsize);
-                    memcpy(saved_hl,row->hl,row->rsize);
-                    memset(row->hl+match_offset,HL_MATCH,qlen);
-                }
                 E.cy = 0;
                 E.cx = match_offset;
                 E.rowoff = current;
                 E.coloff = 0;
                 /* Scroll horizontally as needed. */
-                if (E.cx > E.screencols) {
-                    int diff = E.cx - E.screencols;
+                if (E.cx > E.textcols) {
+                    int diff = E.cx - E.textcols;
                     E.cx -= diff;
                     E.coloff += diff;
                 }
@@ -1021,6 +3891,494 @@ void editorFind() {
     }
 }
 
+/* Pick a symbol of the index by typing a prefix of its name. The cursor
+ * follows the selected symbol, arrows step through the symbols sharing the
+ * prefix, ENTER keeps the position and ESC goes back. */
+void editorPickSymbol(void) {
+    char query[SYM_MAX_LEN+1] = {0};
+    int qlen = 0, sel = 0;
+
+    /* Save the cursor position in order to restore it later. */
+    int saved_cx = E.cx, saved_cy = E.cy;
+    int saved_coloff = E.coloff, saved_rowoff = E.rowoff;
+
+    editorSyntaxCatchUp(E.numrows-1);
+    while(1) {
+        int first = symSearch(query,-1), count = 0;
+
+        while (first+count < E.nsyms &&
+               !strncmp(E.row[E.syms[first+count]].sym,query,qlen)) count++;
+        if (count) {
+            if (sel < 0) sel = count-1;
+            if (sel >= count) sel = 0;
+            editorSetCursor(E.syms[first+sel],0);
+            editorSetStatusMessage("Symbol: %s -> %s (%d of %d)", query,
+                E.row[E.syms[first+sel]].sym, sel+1, count);
+        } else {
+            editorSetStatusMessage("Symbol: %s (no match)", query);
+        }
+        editorRefreshScreen();
+
+        int c = cli_getchar(0);
+        c = c & 0xFFFF;
+        if (c == BACKSPACE) {
+            if (qlen != 0) query[--qlen] = '\0';
+            sel = 0;
+        } else if (c == ESC || c == ENTER) {
+            if (c == ESC || count == 0) {
+                E.cx = saved_cx; E.cy = saved_cy;
+                E.coloff = saved_coloff; E.rowoff = saved_rowoff;
+            }
+            editorSetStatusMessage("");
+            return;
+        } else if (c == CLI_KEY_RIGHT || c == CLI_KEY_DOWN) {
+            sel++;
+        } else if (c == CLI_KEY_LEFT || c == CLI_KEY_UP) {
+            sel--;
+        } else if (isprint(c)) {
+            if (qlen < SYM_MAX_LEN) {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+                sel = 0;
+            }
+        }
+    }
+}
+
+/* ============================== Replace mode ============================== */
+
+/* Read a line of text into 'buf' (KILO_QUERY_LEN+1 bytes) in the status
+ * bar, after 'label'. Unless 'mode' is NULL, ^A ^W ^R toggle its SEARCH_*
+ * flags like in the search prompt. Return 0 if ESC was pressed. */
+int editorPrompt(const char *label, char *buf, int *mode) {
+    int len = strlen(buf);
+
+    while(1) {
+        if (mode)
+            editorSetStatusMessage("%s%s%s%s: %s (ESC/Enter, ^A ^W ^R modes)",
+                label, (*mode & SEARCH_NOCASE) ? " [Aa]" : "",
+                (*mode & SEARCH_WORD) ? " [word]" : "",
+                (*mode & SEARCH_REGEX) ? " [re]" : "", buf);
+        else
+            editorSetStatusMessage("%s: %s (ESC/Enter)", label, buf);
+        editorRefreshScreen();
+
+        int c = cli_getchar(0);
+        c = c & 0xFFFF;
+        if (c == BACKSPACE) {
+            if (len != 0) buf[--len] = '\0';
+        } else if (c == ESC || c == ENTER) {
+            editorSetStatusMessage("");
+            return c == ENTER;
+        } else if (mode && (c == CTRL_A || c == CTRL_W || c == CTRL_R)) {
+            *mode ^= (c == CTRL_A) ? SEARCH_NOCASE :
+                     (c == CTRL_W) ? SEARCH_WORD : SEARCH_REGEX;
+        } else if (isprint(c)) {
+            if (len < KILO_QUERY_LEN) {
+                buf[len++] = c;
+                buf[len] = '\0';
+            }
+        }
+    }
+}
+
+/* Replace by the 'rlen' bytes at 'rep' up to 'max' matches of 'q' in 'row'
+ * starting at or after char 'from'. The new content is built in a single
+ * allocation, but neither the render nor the highlight of the row are
+ * updated: that is left to the caller, once it is done with the row.
+ * Return the number of matches replaced, and store in '*next' (unless it
+ * is NULL) the offset in the new content where searching should resume. */
+int editorReplaceInRow(erow *row, struct searchQuery *q, int from,
+                       const char *rep, int rlen, int max, int *next) {
+    static int *offs = NULL, offscap = 0; /* Match offset, length pairs. */
+    int word = q->flags & SEARCH_WORD;
+    int n = 0, i = from, off, len, size, j;
+    char *chars, *p;
+
+    /* First find every match to size the new content. */
+    size = row->size;
+    while (n < max && (off = searchBuffer(q,row->chars,row->size,i,word,
+                                          &len)) != -1) {
+        if (n*2+2 > offscap) {
+            offscap = offscap ? offscap*2 : 64;
+            offs = realloc(offs,sizeof(int)*offscap);
+        }
+        offs[n*2] = off;
+        offs[n*2+1] = len;
+        n++;
+        size += rlen-len;
+        /* After an empty match, resume past the next char. */
+        i = off+len+(len == 0);
+    }
+    if (n == 0) {
+        if (next) *next = row->size+1;
+        return 0;
+    }
+
+    p = chars = malloc(size+1);
+    i = 0;
+    for (j = 0; j < n; j++) {
+        off = offs[j*2];
+        len = offs[j*2+1];
+        memcpy(p,row->chars+i,off-i);
+        p += off-i;
+        memcpy(p,rep,rlen);
+        p += rlen;
+        i = off+len;
+        if (len == 0 && i < row->size) *p++ = row->chars[i++];
+    }
+    /* An empty match at the end of the row leaves nothing to skip there:
+     * resume past the end, on the next row. */
+    if (next) *next = p-chars+(len == 0 && off == row->size);
+    memcpy(p,row->chars+i,row->size-i);
+    chars[size] = '\0';
+    free(row->chars);
+    row->chars = chars;
+    row->size = size;
+    return n;
+}
+
+/* Replace every match of 'q' from char 'from' of row 'at' to the end of
+ * the file. Each row is rewritten once with all its replacements, and the
+ * rows changed are only rendered and highlighted again at the end. The
+ * whole operation counts as a single change. Return the matches replaced. */
+int editorReplaceAll(struct searchQuery *q, int at, int from,
+                     const char *rep, int rlen) {
+    int *changed = malloc(sizeof(int)*(E.numrows-at+1));
+    int nchanged = 0, count = 0, n, j;
+
+    for (j = at; j < E.numrows; j++) {
+        n = editorReplaceInRow(&E.row[j],q,(j == at) ? from : 0,rep,rlen,
+                               INT_MAX,NULL);
+        if (n) {
+            changed[nchanged++] = j;
+            count += n;
+        }
+    }
+    for (j = 0; j < nchanged; j++) editorUpdateRow(&E.row[changed[j]]);
+    free(changed);
+    if (count) E.dirty++;
+    return count;
+}
+
+/* Ask for a query and its replacement, then step through the matches from
+ * the top of the file: 'y' replaces the one highlighted, 'n' skips it, 'a'
+ * replaces it and all the following ones, ESC stops. */
+void editorReplace(void) {
+    char query[KILO_QUERY_LEN+1] = {0}, rep[KILO_QUERY_LEN+1] = {0};
+    struct searchQuery q;
+    int row = 0, from = 0, count = 0, rlen, off, len;
+
+    if (!editorPrompt("Replace",query,&searchMode) || query[0] == '\0')
+        return;
+    if (!editorPrompt("Replace with",rep,NULL)) return;
+    rlen = strlen(rep);
+    q.rx = NULL;
+    searchCompile(&q,query,strlen(query),searchMode);
+    if (q.err) {
+        editorSetStatusMessage("Bad pattern: %s",q.err);
+        return;
+    }
+
+    while (row < E.numrows) {
+        erow *r = &E.row[row];
+        struct hlSpan *saved_hl;
+        int c, rx;
+
+        off = (from <= r->size) ? searchBuffer(&q,r->chars,r->size,from,
+                                  searchMode & SEARCH_WORD,&len) : -1;
+        if (off == -1) {
+            row++;
+            from = 0;
+            continue;
+        }
+
+        /* Show the match and ask what to do with it. */
+        editorSetCursor(row,off);
+        editorSyntaxCatchUp(row);
+        saved_hl = editorSaveHighlight(r);
+        rx = editorRowCxToRx(r,off);
+        hlFill(r,rx,editorRowCxToRx(r,off+len)-rx,HL_MATCH);
+        editorSetStatusMessage("Replace this match? (y/n/a, ESC)");
+        editorRefreshScreen();
+        c = cli_getchar(0) & 0xFFFF;
+        editorRestoreHighlight(r,saved_hl);
+
+        if (c == 'y' || c == 'Y') {
+            count += editorReplaceInRow(r,&q,off,rep,rlen,1,&from);
+            editorUpdateRow(r);
+            E.dirty++;
+        } else if (c == 'n' || c == 'N') {
+            from = off+len+(len == 0);
+        } else if (c == 'a' || c == 'A') {
+            count += editorReplaceAll(&q,row,off,rep,rlen);
+            break;
+        } else if (c == ESC) {
+            break;
+        }
+    }
+    rxFree(q.rx);
+    editorSetStatusMessage("Replaced %d occurrence%s",count,
+                           (count == 1) ? "" : "s");
+}
+
+/* ============================ Search in files ============================= */
+
+#define GREP_BUF 2048       /* Bytes of a file held in memory at a time. */
+#define GREP_MAX_HITS 1000  /* Hits listed, the others are only counted. */
+#define GREP_TEXT_LEN 64    /* Bytes of the matching line kept per hit. */
+#define GREP_ATTR_DIR 0x10  /* FAT attribute of a subdirectory. */
+
+struct grepHit {
+    int file;                   /* Index in grep.files. */
+    long line;                  /* Line number, starting at 1. */
+    char text[GREP_TEXT_LEN+1]; /* Start of the line, indent dropped. */
+};
+
+/* Results of the last search in files, kept to be browsed again. */
+static struct {
+    char **files;           /* Path of every file with a hit. */
+    int nfiles;
+    struct grepHit *hits;
+    int nhits;
+    int cap;                /* Hits there is room for. */
+    long total;             /* Hits found, including the unlisted ones. */
+    int scanned;            /* Files searched. */
+    int sel;                /* Hit last picked. */
+} grep;
+
+static char grepBuf[GREP_BUF];
+
+void grepFree(void) {
+    int j;
+
+    for (j = 0; j < grep.nfiles; j++) free(grep.files[j]);
+    free(grep.files);
+    free(grep.hits);
+    memset(&grep,0,sizeof(grep));
+}
+
+/* Record a hit at 'line' of the last file of grep.files. Return 0 if there
+ * is no memory left for it. */
+int grepAddHit(long line, const char *s, int len) {
+    struct grepHit *h;
+    int j;
+
+    grep.total++;
+    if (grep.nhits == GREP_MAX_HITS) return 1;
+    if (grep.nhits == grep.cap) {
+        int cap = grep.cap ? grep.cap*2 : 16;
+        if (cap > GREP_MAX_HITS) cap = GREP_MAX_HITS;
+        h = realloc(grep.hits,sizeof(struct grepHit)*cap);
+        if (h == NULL) return 0;
+        grep.hits = h;
+        grep.cap = cap;
+    }
+    h = &grep.hits[grep.nhits++];
+    h->file = grep.nfiles-1;
+    h->line = line;
+    while (len && isspace((unsigned char)*s)) {
+        s++;
+        len--;
+    }
+    if (len > GREP_TEXT_LEN) len = GREP_TEXT_LEN;
+    for (j = 0; j < len; j++)
+        h->text[j] = isprint((unsigned char)s[j]) ? s[j] : ' ';
+    h->text[len] = '\0';
+    return 1;
+}
+
+/* Search the file at 'path' for 'q', one GREP_BUF sized piece at a time,
+ * and record the lines that match. Lines longer than GREP_BUF are searched
+ * in pieces, so a match straddling two of them is missed. Return 0 if the
+ * memory ran out. */
+int grepFile(struct searchQuery *q, int word, const char *path) {
+    FILE *fp = fopen(path,"r");
+    long line = 1;
+    int len = 0, eof = 0, found = 0, start, end, n;
+    char **files;
+
+    if (fp == NULL) return 1;
+    grep.scanned++;
+    while (!eof || len) {
+        if (!eof) {
+            n = fread(grepBuf+len,1,GREP_BUF-len,fp);
+            if (n <= 0) eof = 1;
+            else len += n;
+        }
+        /* Search the complete lines, leaving the last one for the next read
+         * unless it fills the buffer or the file ends there. */
+        start = 0;
+        while (start < len) {
+            char *nl = memchr(grepBuf+start,'\n',len-start);
+
+            if (nl) end = nl-grepBuf;
+            else if (eof || (start == 0 && len == GREP_BUF)) end = len;
+            else break;
+            n = (end > start && grepBuf[end-1] == '\r') ? end-1 : end;
+            if (!found &&
+                searchBuffer(q,grepBuf+start,n-start,0,word,NULL) != -1) {
+                found = 1;
+                if (grep.nfiles == 0 ||
+                    strcmp(grep.files[grep.nfiles-1],path)) {
+                    files = realloc(grep.files,sizeof(char*)*(grep.nfiles+1));
+                    if (files == NULL) goto oom;
+                    grep.files = files;
+                    if ((files[grep.nfiles] = strdup(path)) == NULL) goto oom;
+                    grep.nfiles++;
+                }
+                if (!grepAddHit(line,grepBuf+start,n-start)) goto oom;
+            }
+            start = end;
+            if (nl) {
+                start++;
+                line++;
+                found = 0;
+            }
+        }
+        memmove(grepBuf,grepBuf+start,len-start);
+        len -= start;
+    }
+    fclose(fp);
+    return 1;
+
+oom:
+    fclose(fp);
+    return 0;
+}
+
+/* Search for 'q' every file matching 'where', a directory followed by a
+ * pattern like "*.c" after its last '/'. Subdirectories are skipped. ESC
+ * stops the search, other keys typed meanwhile are dropped. */
+void grepFiles(struct searchQuery *q, int word, const char *where) {
+    char dir[MAX_PATH_LEN], path[MAX_PATH_LEN];
+    const char *pattern = strrchr(where,'/');
+    t_file_info info;
+    int d, ok = 1;
+
+    grepFree();
+    if (pattern) {
+        int dlen = (pattern == where) ? 1 : pattern-where;
+        if (dlen >= MAX_PATH_LEN) dlen = MAX_PATH_LEN-1;
+        memcpy(dir,where,dlen);
+        dir[dlen] = '\0';
+        pattern++;
+    } else {
+        if (sys_fsys_get_cwd(dir,MAX_PATH_LEN) < 0) dir[0] = '\0';
+        pattern = where;
+    }
+    if (pattern[0] == '\0') pattern = "*";
+
+    d = sys_fsys_findfirst(dir,pattern,&info);
+    if (d < 0) {
+        editorSetStatusMessage("Can't read directory %s",dir);
+        return;
+    }
+    do {
+        if (info.name[0] == '\0') break;
+        if (info.attributes & GREP_ATTR_DIR) continue;
+        snprintf(path,sizeof(path),"%s%s%s",dir,
+                 (dir[0] && dir[strlen(dir)-1] != '/' &&
+                  dir[strlen(dir)-1] != ':') ? "/" : "",info.name);
+        editorSetStatusMessage("Searching %s (ESC stops)",path);
+        editorRefreshScreen();
+        ok = grepFile(q,word,path);
+        while (cli_key_pending(0))
+            if ((cli_getchar(0) & 0xFFFF) == ESC) ok = -1;
+        if (ok != 1) break;
+    } while (sys_fsys_findnext(d,&info) >= 0);
+    sys_fsys_closedir(d);
+
+    editorSetStatusMessage("%ld line%s in %d of %d files%s%s",grep.total,
+        (grep.total == 1) ? "" : "s",grep.nfiles,grep.scanned,
+        (ok == 1) ? "" : (ok == 0) ? ", out of memory" : ", stopped",
+        (grep.total > grep.nhits) ? ", not all listed" : "");
+}
+
+/* Open 'filename' at 'line' in place of the current file. Return 0 if the
+ * current file has unsaved changes. */
+int editorOpenAt(const char *filename, long line) {
+    if (E.filename == NULL || strcmp(E.filename,filename)) {
+        if (E.dirty) return 0;
+        editorCloseFile();
+        editorSelectSyntaxHighlight(filename);
+        editorOpen(filename);
+    }
+    if (line > E.numrows) line = E.numrows;
+    editorSetCursor(line > 0 ? line-1 : 0,0);
+    return 1;
+}
+
+/* Step through the hits of the last search in files with the arrows: ENTER
+ * opens the file at the line of the hit, ESC goes back. */
+void grepPick(void) {
+    while (grep.nhits) {
+        struct grepHit *h;
+        const char *name;
+        int c;
+
+        if (grep.sel < 0) grep.sel = grep.nhits-1;
+        if (grep.sel >= grep.nhits) grep.sel = 0;
+        h = &grep.hits[grep.sel];
+        name = strrchr(grep.files[h->file],'/');
+        name = name ? name+1 : grep.files[h->file];
+        editorSetStatusMessage("%d/%d%s %s:%ld: %s",grep.sel+1,grep.nhits,
+            (grep.total > grep.nhits) ? "+" : "",name,h->line,h->text);
+        editorRefreshScreen();
+
+        c = cli_getchar(0) & 0xFFFF;
+        if (c == ESC) {
+            editorSetStatusMessage("");
+            return;
+        } else if (c == ENTER) {
+            if (editorOpenAt(grep.files[h->file],h->line))
+                editorSetStatusMessage("");
+            else
+                editorSetStatusMessage("Unsaved changes: save with Ctrl+S "
+                                       "before opening %s",name);
+            return;
+        } else if (c == CLI_KEY_RIGHT || c == CLI_KEY_DOWN) {
+            grep.sel++;
+        } else if (c == CLI_KEY_LEFT || c == CLI_KEY_UP) {
+            grep.sel--;
+        }
+    }
+}
+
+/* Search the files of a directory. An empty query browses the hits of the
+ * last search again. */
+void editorGrep(void) {
+    static char where[KILO_QUERY_LEN+1];
+    char query[KILO_QUERY_LEN+1] = {0};
+    struct searchQuery q;
+
+    if (!editorPrompt("Search in files",query,&searchMode)) return;
+    if (query[0] == '\0') {
+        if (grep.nhits == 0) editorSetStatusMessage("No hits to show");
+        grepPick();
+        return;
+    }
+    if (where[0] == '\0') {
+        /* Default to the directory of the current file. */
+        const char *slash = E.filename ? strrchr(E.filename,'/') : NULL;
+        int dlen = slash ? slash-E.filename+1 : 0;
+        if (dlen > KILO_QUERY_LEN-1) dlen = 0;
+        if (dlen) memcpy(where,E.filename,dlen);
+        strcpy(where+dlen,"*");
+    }
+    if (!editorPrompt("In files",where,NULL)) return;
+    q.rx = NULL;
+    searchCompile(&q,query,strlen(query),searchMode);
+    if (q.err) {
+        editorSetStatusMessage("Bad pattern: %s",q.err);
+        rxFree(q.rx);
+        return;
+    }
+    grepFiles(&q,searchMode & SEARCH_WORD,where);
+    rxFree(q.rx);
+    grepPick();
+}
+
 /* ========================= Editor events handling  ======================== */
 void editorMoveHome() {
     E.coloff = 0;
@@ -1035,8 +4393,8 @@ void editorMoveEnd() {
     rowlen = row ? row->size : 0;
 
     if (rowlen > 0) {
-        if (rowlen > E.screencols) {
-            E.coloff =  rowlen / E.screencols * E.screencols;
+        if (rowlen > E.textcols) {
+            E.coloff =  rowlen / E.textcols * E.textcols;
             E.cx = rowlen - E.coloff;
         } else {
             E.coloff = 0;
@@ -1045,13 +4403,39 @@ void editorMoveEnd() {
     }
 }
 
+/* Show or hide the line number gutter. */
+void editorToggleLineNumbers() {
+    E.linenums = !E.linenums;
+    editorUpdateGutter();
+}
+
+/* Fix cx if the current line has not enough chars. */
+void editorClampCursor(void) {
+    int filerow = E.rowoff+E.cy;
+    int filecol = E.coloff+E.cx;
+    erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
+    int rowlen = row ? row->size : 0;
+
+    if (filecol > rowlen) {
+        E.cx -= filecol-rowlen;
+        if (E.cx < 0) {
+            E.coloff += E.cx;
+            E.cx = 0;
+        }
+    }
+}
+
 /* Handle cursor position change because arrow keys were pressed. */
 void editorMoveCursor(int key) {
     int filerow = E.rowoff+E.cy;
     int filecol = E.coloff+E.cx;
-    int rowlen;
     erow *row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
 
+    if (E.softwrap && (key == CLI_KEY_UP || key == CLI_KEY_DOWN)) {
+        editorMoveVisual(key == CLI_KEY_UP ? -1 : 1);
+        return;
+    }
+
     switch(key) {
     case CLI_KEY_LEFT:
         if (E.cx == 0) {
@@ -1061,9 +4445,9 @@ void editorMoveCursor(int key) {
                 if (filerow > 0) {
                     E.cy--;
                     E.cx = E.row[filerow-1].size;
-                    if (E.cx > E.screencols-1) {
-                        E.coloff = E.cx-E.screencols+1;
-                        E.cx = E.screencols-1;
+                    if (E.cx > E.textcols-1) {
+                        E.coloff = E.cx-E.textcols+1;
+                        E.cx = E.textcols-1;
                     }
                 }
             }
@@ -1073,7 +4457,7 @@ void editorMoveCursor(int key) {
         break;
     case CLI_KEY_RIGHT:
         if (row && filecol < row->size) {
-            if (E.cx == E.screencols-1) {
+            if (E.cx == E.textcols-1) {
                 E.coloff++;
             } else {
                 E.cx += 1;
@@ -1105,28 +4489,77 @@ void editorMoveCursor(int key) {
         }
         break;
     }
-    /* Fix cx if the current line has not enough chars. */
-    filerow = E.rowoff+E.cy;
-    filecol = E.coloff+E.cx;
-    row = (filerow >= E.numrows) ? NULL : &E.row[filerow];
-    rowlen = row ? row->size : 0;
-    if (filecol > rowlen) {
-        E.cx -= filecol-rowlen;
-        if (E.cx < 0) {
-            E.coloff += E.cx;
-            E.cx = 0;
-        }
-    }
+    editorClampCursor();
 }
 
+/* Move the cursor a screen up or down, scrolling just enough to keep it
+ * visible, as that many presses of the arrow would. The target line is
+ * computed, so the cost doesn't depend on the screen height. */
 void editorMovePage(int key) {
-    int dir = CLI_KEY_DOWN;
-    if (key == (CLI_FLAG_CTRL | CLI_KEY_UP)) {
-        dir = CLI_KEY_UP;
+    int dir = (key == (CLI_FLAG_CTRL | CLI_KEY_UP)) ? -1 : 1;
+    int filerow = E.rowoff+E.cy, target, v, vx;
+
+    if (E.softwrap) {
+        editorUpdateVisIndex();
+        v = editorCursorVisual(&vx);
+        target = v+dir*E.screenrows;
+        if (target >= E.numvis) target = (v > E.numvis-1) ? v : E.numvis-1;
+        if (target < 0) target = 0;
+        if (target != v) editorMoveVisual(target-v);
+        return;
     }
-    for(int i=0; i<E.screenrows; i++) editorMoveCursor(dir);
+    target = filerow+dir*E.screenrows;
+    if (target >= E.numrows) target = (filerow > E.numrows-1) ? filerow :
+                                                                E.numrows-1;
+    if (target < 0) target = 0;
+    if (target < E.rowoff)
+        E.rowoff = target;
+    else if (target >= E.rowoff+E.screenrows)
+        E.rowoff = target-E.screenrows+1;
+    E.cy = target-E.rowoff;
+    editorClampCursor();
 }
 
+/* Jump to the line number typed in the status bar, or N lines down or up
+ * with +N or -N, and center it on screen. */
+void editorGotoLine(void) {
+    char buf[KILO_QUERY_LEN+1] = {0};
+    char *end;
+    long line;
+
+    if (!editorPrompt("Go to line (+N/-N relative)",buf,NULL) ||
+        buf[0] == '\0') return;
+    line = strtol(buf,&end,10);
+    if (*end != '\0' || !isdigit((unsigned char)buf[buf[0] == '+' ||
+                                                    buf[0] == '-'])) {
+        editorSetStatusMessage("Not a line number: %s",buf);
+        return;
+    }
+    if (line > E.numrows) line = E.numrows;
+    if (line < -E.numrows) line = -E.numrows;
+    if (buf[0] == '+' || buf[0] == '-') line += E.rowoff+E.cy+1;
+    if (line > E.numrows) line = E.numrows;
+    if (line < 1) line = 1;
+
+    E.cx = E.coloff = 0;
+    if (E.softwrap) {
+        E.rowoff = line-1;
+        E.cy = 0;
+        editorUpdateVisIndex();
+        E.vtop = (E.rowoff < E.numrows) ? E.row[E.rowoff].vis : 0;
+        E.vtop -= E.screenrows/2;
+        if (E.vtop < 0) E.vtop = 0;
+        return;
+    }
+    E.rowoff = line-1-E.screenrows/2;
+    if (E.rowoff < 0) E.rowoff = 0;
+    E.cy = line-1-E.rowoff;
+}
+
+/* Maximum number of jiffies (1/60 s) the screen may go without a refresh
+ * while keys keep arriving faster than we can paint. */
+#define EDIT_PAINT_LATENCY 10
+
 /* Process events arriving from the standard input, which is, the user
  * is typing stuff on the terminal. */
 #define EDIT_QUIT_TIMES 3
@@ -1165,6 +4598,30 @@ void editorProcessKeypress() {
             case CTRL_R:
                 runInterpreter();
                 break;
+            case CTRL_L:
+                editorToggleLineNumbers();
+                break;
+            case CTRL_T:
+                editorToggleSoftWrap();
+                break;
+            case CTRL_B:
+                editorJumpToBracket();
+                break;
+            case CTRL_O:
+                editorPickSymbol();
+                break;
+            case CTRL_D:
+                editorGotoDefinition();
+                break;
+            case CTRL_E:
+                editorReplace();
+                break;
+            case CTRL_F:
+                editorGrep();
+                break;
+            case CTRL_G:
+                editorGotoLine();
+                break;
         
             default:
                 if (c >= 0x20) {
@@ -1220,6 +4677,7 @@ void updateWindowSize(void) {
         E.screenrows  = 80;
         E.screencols = 25;
     }
+    E.textcols = E.screencols - E.gutter;
 
     E.screenrows -= 2; /* Get room for status bar. */
 }
@@ -1247,6 +4705,27 @@ void initEditor(void) {
     E.dirty = 0;
     E.filename = NULL;
     E.syntax = NULL;
+    E.hl_lo = INT_MAX;
+    E.hl_hi = -1;
+    E.hl_eof = HL_STATE_NORMAL;
+    E.br_tree = NULL;
+    E.br_size = 0;
+    E.br_rebuild = 0;
+    E.syms = NULL;
+    E.nsyms = 0;
+    E.tri_bits = NULL;
+    E.tri_stale = NULL;
+    E.tri_off = 0;
+    E.statusmsglen = 0;
+    E.statusbar = NULL;
+    E.linenums = 0;
+    E.gutter = 0;
+    E.softwrap = 0;
+    E.vtop = 0;
+    E.vis_row = NULL;
+    E.numvis = 0;
+    E.vis_cols = 0;
+    E.vis_lo = 0;
     initHLDB();
 
     chan_dev = sys_chan_device(0);
@@ -1384,7 +4863,24 @@ int main(int argc, char **argv) {
         "Press HELP key for instructions.");
     while(1) {
         editorRefreshScreen();
-        editorProcessKeypress();
+        /* Spend the time until the next key on the search index, and show
+         * the message it may have set. Rebuilding a block shows nothing, so
+         * an edit doesn't cost a second refresh. */
+        if (triIdleStep()) {
+            long shown = E.statusmsg_deadline;
+            while (!cli_key_pending(0) && triIdleStep());
+            if (!cli_key_pending(0) && E.statusmsg_deadline != shown)
+                editorRefreshScreen();
+        }
+        /* Keys that are already buffered (auto-repeat, fast typing) are
+         * processed before repainting, so a burst costs a single refresh.
+         * The screen is still refreshed every EDIT_PAINT_LATENCY jiffies
+         * while the burst lasts. */
+        long painted = sys_time_jiffies();
+        do {
+            editorProcessKeypress();
+        } while (cli_key_pending(0) &&
+                 sys_time_jiffies()-painted < EDIT_PAINT_LATENCY);
     }
     return 0;
 }
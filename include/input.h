@@ -39,6 +39,14 @@ enum ControlKeys {
  */
 short cli_getchar(short channel);
 
+/**
+ * Check if the console has buffered input that can be read without blocking
+ *
+ * @param channel the number of the input channel
+ * @return non-zero if a key is waiting to be read
+ */
+short cli_key_pending(short channel);
+
 /**
  * Make sure all the console settings are setup so that the console works correctly
  */
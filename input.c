@@ -132,6 +132,17 @@ short cli_translate_numeric(short modifiers, short code) {
     return key_code;
 }
 
+/**
+ * Check if the console has buffered input that can be read without blocking
+ *
+ * @param channel the number of the input channel
+ * @return non-zero if a key is waiting to be read
+ */
+short cli_key_pending(short channel) {
+    short status = sys_chan_status(channel);
+    return (status > 0) && (status & CDEV_STAT_READABLE);
+}
+
 /**
  * Get a character from the console, processing recognized escape sequences
  *